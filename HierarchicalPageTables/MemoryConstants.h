@@ -36,4 +36,16 @@ typedef int word_t;
 
 // the weights for the evacuation algorithm
 #define WEIGHT_EVEN 4
-#define WEIGHT_ODD 2
\ No newline at end of file
+#define WEIGHT_ODD 2
+
+// the translation cache in front of the page tables: the number of pages it holds and how many of them
+// share a set. the number of entries must be a multiple of the associativity.
+#ifndef TLB_ENTRIES
+#define TLB_ENTRIES 16
+#endif
+#ifndef TLB_ASSOCIATIVITY
+#define TLB_ASSOCIATIVITY 4
+#endif
+#define TLB_SETS (TLB_ENTRIES / TLB_ASSOCIATIVITY)
+static_assert(TLB_ASSOCIATIVITY > 0 && TLB_ENTRIES % TLB_ASSOCIATIVITY == 0 && TLB_SETS > 0,
+              "TLB_ENTRIES must be a positive multiple of TLB_ASSOCIATIVITY");
@@ -1,16 +1,105 @@
 #include "VirtualMemory.h"
 #include "PhysicalMemory.h"
+#include <map>
+#include <set>
 
 #define PAPA_OFFSET TABLES_DEPTH-1
 #define DATA_FRAME_OFFSET TABLES_DEPTH
 
 
+// what the page tables hold about a frame, kept next to them so finding a frame doesn't walk the whole tree.
 typedef struct {
-    uint64_t frameIndexToEvict;
-    uint64_t pageNumberToEvict;
-    uint64_t maxWeight;
+    bool inUse;
+    bool isTable;
+    // the physical address of the entry that points to the frame, in its papa table.
     uint64_t pAddressOfFrameInPapa;
-} EvictionStruct;
+    // the page in the frame, or for a table the first page that is mapped through it.
+    uint64_t pageNumber;
+    // the weights of the frames on the way from the root to this frame, and of the page for a page frame.
+    uint64_t weight;
+    // for a table, how many of its entries are not 0.
+    uint64_t numberOfChildren;
+} FrameMetadata;
+
+static FrameMetadata frames[NUM_FRAMES];
+
+// the page frames in the order they are evicted in: the largest weight first, then the smallest page number.
+struct EvictionOrder {
+    bool operator()(uint64_t lhs, uint64_t rhs) const {
+        return frames[lhs].weight > frames[rhs].weight ||
+               (frames[lhs].weight == frames[rhs].weight && frames[lhs].pageNumber < frames[rhs].pageNumber);
+    }
+};
+static std::set<uint64_t, EvictionOrder> pageFrames;
+
+// the tables other than the root with all their entries 0, by their page numbers. tables without children
+// are never an ancestor of one another, so this is the order a dfs from the root finds them in.
+static std::map<uint64_t, uint64_t> emptyTables;
+
+// frames are only unlinked to be used again right away, so the used frames are always the lowest ones and
+// the frames from this one up are free.
+static uint64_t nextUnusedFrame = 1;
+
+typedef struct {
+    bool valid;
+    uint64_t pageNumber;
+    uint64_t frameIndex;
+    // the tlb clock when the entry was last used, the least recently used entry of a set is replaced.
+    uint64_t lastUse;
+} TLBEntry;
+
+// a page is cached in the set of its page number modulo TLB_SETS, so consecutive pages fall in different sets.
+static TLBEntry tlb[TLB_SETS][TLB_ASSOCIATIVITY];
+static uint64_t tlbClock = 0;
+static TLBStats tlbStats = {0, 0};
+
+void tlbFlush() {
+    for (int set = 0; set < TLB_SETS; ++set) {
+        for (int way = 0; way < TLB_ASSOCIATIVITY; ++way) {
+            tlb[set][way].valid = false;
+        }
+    }
+    tlbClock = 0;
+    tlbStats.hits = 0;
+    tlbStats.misses = 0;
+}
+
+TLBEntry* tlbLookup(uint64_t pageNumber) {
+    TLBEntry* set = tlb[pageNumber % TLB_SETS];
+    for (int way = 0; way < TLB_ASSOCIATIVITY; ++way) {
+        if (set[way].valid && set[way].pageNumber == pageNumber) {
+            return &set[way];
+        }
+    }
+    return nullptr;
+}
+
+void tlbInsert(uint64_t pageNumber, uint64_t frameIndex) {
+    TLBEntry* set = tlb[pageNumber % TLB_SETS];
+    TLBEntry* victim = &set[0];
+    for (int way = 0; way < TLB_ASSOCIATIVITY; ++way) {
+        if (!set[way].valid) {
+            victim = &set[way];
+            break;
+        }
+        if (set[way].lastUse < victim->lastUse) {
+            victim = &set[way];
+        }
+    }
+    victim->valid = true;
+    victim->pageNumber = pageNumber;
+    victim->frameIndex = frameIndex;
+    victim->lastUse = ++tlbClock;
+}
+
+// called whenever a page leaves its frame. tables are never cached, and a table is unlinked only once it is
+// all zeros, when no page is mapped through it, so evictions are the only mappings the tlb has to forget.
+void tlbInvalidate(uint64_t pageNumber) {
+    TLBEntry* entry = tlbLookup(pageNumber);
+    if (entry != nullptr) {
+        entry->valid = false;
+    }
+}
 
 void parseVirtualAddress(uint64_t virtualAddress, uint64_t* offsets) {
     uint64_t frameOffsetMask = ((uint64_t)1LL << (uint64_t)OFFSET_WIDTH) - 1;
@@ -26,104 +115,89 @@ void clearTable(uint64_t frameIndex) {
     }
 }
 
+uint64_t frameWeight(uint64_t index) {
+    return (index % 2 == 0) ? WEIGHT_EVEN : WEIGHT_ODD;
+}
+
 void VMinitialize() {
     clearTable(0);
+    tlbFlush();
+    emptyTables.clear();
+    pageFrames.clear();
+    frames[0].inUse = true;
+    frames[0].isTable = true;
+    frames[0].pageNumber = 0;
+    frames[0].weight = frameWeight(0);
+    frames[0].numberOfChildren = 0;
+    for (uint64_t i = 1; i < NUM_FRAMES; ++i) {
+        frames[i].inUse = false;
+    }
+    nextUnusedFrame = 1;
 }
 
-uint64_t getFrameByDFS(word_t currentFrameIndex, uint64_t* maxFrameUsed, int depthCounter, bool* foundUnusedFrame,
-                       uint64_t papaFrameIndex, bool *flag2){
-
-    if (depthCounter == TABLES_DEPTH){
-        return currentFrameIndex;
-    }
-    uint64_t frame;
-    bool  flag = true;
-    for (int i=0; i<PAGE_SIZE; i++){
-        word_t nextFrameIndex;
-        PMread((currentFrameIndex) * PAGE_SIZE + i, &nextFrameIndex);
-        if (nextFrameIndex != 0){
-            flag = false;
-            if (nextFrameIndex >(word_t) *maxFrameUsed){
-                *maxFrameUsed = nextFrameIndex;
-            }
-            frame = getFrameByDFS(nextFrameIndex, maxFrameUsed, depthCounter+1, foundUnusedFrame,
-                                  papaFrameIndex, flag2);
-            if (*foundUnusedFrame){
-                if(frame != papaFrameIndex && *flag2){
-                    *flag2 = false;
-                    PMwrite((currentFrameIndex) * PAGE_SIZE + i, 0);
-                }
-                return frame;
-            }
-        }
+// points the entry of a papa table to a frame holding a table or a page, and records the frame's metadata.
+void linkFrame(uint64_t papaFrameIndex, uint64_t entryIndex, uint64_t frameIndex, bool isTable,
+               uint64_t pageNumber) {
+    PMwrite(papaFrameIndex * PAGE_SIZE + entryIndex, frameIndex);
+    FrameMetadata& papa = frames[papaFrameIndex];
+    if (papa.numberOfChildren++ == 0) {
+        emptyTables.erase(papa.pageNumber);
     }
-
-    // if we reached here it means current frame is full of 0s - unused.
-    if (currentFrameIndex != (word_t)papaFrameIndex && flag) {
-        *foundUnusedFrame = true;
-
+    FrameMetadata& frame = frames[frameIndex];
+    frame.inUse = true;
+    frame.isTable = isTable;
+    frame.pAddressOfFrameInPapa = papaFrameIndex * PAGE_SIZE + entryIndex;
+    frame.pageNumber = pageNumber;
+    frame.weight = papa.weight + frameWeight(frameIndex);
+    frame.numberOfChildren = 0;
+    if (isTable) {
+        emptyTables[pageNumber] = frameIndex;
+    } else {
+        frame.weight += frameWeight(pageNumber);
+        pageFrames.insert(frameIndex);
     }
-    return currentFrameIndex;
 }
 
-
-void getFrameForEvictionByDFS(word_t currentFrameIndex, EvictionStruct &evictionStruct, int depthCounter,
-                              uint64_t pageNumber, uint64_t currentWeight,  uint64_t pAddressOfFrameInPapa)
-{
-    currentWeight += ((currentFrameIndex % 2 == 0) ?WEIGHT_EVEN : WEIGHT_ODD);
-    if (depthCounter == TABLES_DEPTH){
-        currentWeight += ((pageNumber % 2 == 0) ? WEIGHT_EVEN : WEIGHT_ODD);
-        if ((currentWeight > evictionStruct.maxWeight) || (currentWeight == evictionStruct.maxWeight &&
-                                                        (pageNumber < evictionStruct.pageNumberToEvict))) {
-            evictionStruct.maxWeight = currentWeight;
-            evictionStruct.frameIndexToEvict = currentFrameIndex;
-            evictionStruct.pageNumberToEvict = pageNumber;
-            evictionStruct.pAddressOfFrameInPapa = pAddressOfFrameInPapa;
-        }
-        return;
+// zeroes the entry that points to a frame, which is either an empty table or a page that was evicted.
+void unlinkFrame(uint64_t frameIndex) {
+    FrameMetadata& frame = frames[frameIndex];
+    if (frame.isTable) {
+        emptyTables.erase(frame.pageNumber);
+    } else {
+        pageFrames.erase(frameIndex);
     }
-
-    for (int i=0; i<PAGE_SIZE; i++){
-        word_t nextFrameIndex;
-        PMread((currentFrameIndex) * PAGE_SIZE + i, &nextFrameIndex);
-        if (nextFrameIndex != 0) {
-            uint64_t pageIndex = (pageNumber << OFFSET_WIDTH) +i;
-            getFrameForEvictionByDFS(nextFrameIndex, evictionStruct, depthCounter+1, pageIndex,
-                                     currentWeight, (currentFrameIndex) * PAGE_SIZE + i);
-        }
-
+    PMwrite(frame.pAddressOfFrameInPapa, 0);
+    frame.inUse = false;
+    uint64_t papaFrameIndex = frame.pAddressOfFrameInPapa / PAGE_SIZE;
+    FrameMetadata& papa = frames[papaFrameIndex];
+    if (--papa.numberOfChildren == 0 && papaFrameIndex != 0) {
+        emptyTables[papa.pageNumber] = papaFrameIndex;
     }
 }
 
-// done using dfs
+// returns an empty table other than papaFrameIndex, the lowest frame that was never used, or the frame of
+// the page with the largest weight, in that order.
 uint64_t findSuitedFrame(uint64_t papaFrameIndex){
-    bool foundUnusedFrame = false;
-    uint64_t maxFrameUsed = 0;
-    bool flag2 = true;
-    uint64_t suitedFrameIndex = getFrameByDFS(0, &maxFrameUsed, 0, &foundUnusedFrame,
-                                              papaFrameIndex, &flag2);
-    // if case 1:
-    if (foundUnusedFrame) {
-        if (suitedFrameIndex != papaFrameIndex) {
-
+    for (auto table = emptyTables.begin(); table != emptyTables.end(); ++table) {
+        if (table->second != papaFrameIndex) {
+            uint64_t tableFrameIndex = table->second;
+            unlinkFrame(tableFrameIndex);
+            return tableFrameIndex;
         }
-        return suitedFrameIndex;
     }
-    // if case 2
-    if (maxFrameUsed + 1 < NUM_FRAMES){
-        return maxFrameUsed + 1;
+    if (nextUnusedFrame < NUM_FRAMES){
+        return nextUnusedFrame++;
     }
-    EvictionStruct evictionStruct = {0, 0, 0, 0};
-    getFrameForEvictionByDFS(0, evictionStruct, 0,0,  0, 0);
-
-    PMevict(evictionStruct.frameIndexToEvict, evictionStruct.pageNumberToEvict);
-    PMwrite(evictionStruct.pAddressOfFrameInPapa, 0);
-
-    return evictionStruct.frameIndexToEvict;
+    uint64_t frameIndexToEvict = *pageFrames.begin();
+    uint64_t pageNumberToEvict = frames[frameIndexToEvict].pageNumber;
+    PMevict(frameIndexToEvict, pageNumberToEvict);
+    unlinkFrame(frameIndexToEvict);
+    tlbInvalidate(pageNumberToEvict);
 
+    return frameIndexToEvict;
 }
 
-uint64_t getSuitedPAddress(uint64_t virtualAddress){
+uint64_t walkPageTables(uint64_t virtualAddress){
     uint64_t framesOffsets[TABLES_DEPTH+1];
     parseVirtualAddress(virtualAddress, framesOffsets);
     word_t nextFrameIndex = 0;
@@ -133,10 +207,13 @@ uint64_t getSuitedPAddress(uint64_t virtualAddress){
         papaFrameIndex = nextFrameIndex;
         PMread(nextFrameIndex * PAGE_SIZE + framesOffsets[i], &nextFrameIndex);
         if (nextFrameIndex == 0) {
-            // start searching for unused frame using dfs from the root.
+            // take an empty table, a free frame or the frame of a page to evict.
             uint64_t availableFrameIndex = findSuitedFrame(papaFrameIndex);
             clearTable(availableFrameIndex);
-            PMwrite(papaFrameIndex * PAGE_SIZE + framesOffsets[i], availableFrameIndex);
+            // the first page mapped through the new table, which is i + 1 levels below the root.
+            uint64_t tableShift = OFFSET_WIDTH * (TABLES_DEPTH - (i + 1));
+            uint64_t tablePageNumber = ((virtualAddress >> OFFSET_WIDTH) >> tableShift) << tableShift;
+            linkFrame(papaFrameIndex, framesOffsets[i], availableFrameIndex, true, tablePageNumber);
             nextFrameIndex = availableFrameIndex;
         }
     }
@@ -149,7 +226,7 @@ uint64_t getSuitedPAddress(uint64_t virtualAddress){
             // restoring suited page for available frame found
             uint64_t pageIndex = virtualAddress >> OFFSET_WIDTH;
             PMrestore(availableFrameIndex, pageIndex);
-            PMwrite(papaFrameIndex * PAGE_SIZE + framesOffsets[PAPA_OFFSET], availableFrameIndex);
+            linkFrame(papaFrameIndex, framesOffsets[PAPA_OFFSET], availableFrameIndex, false, pageIndex);
             nextFrameIndex = availableFrameIndex;
         }
     }
@@ -157,6 +234,22 @@ uint64_t getSuitedPAddress(uint64_t virtualAddress){
     return nextFrameIndex * PAGE_SIZE + framesOffsets[DATA_FRAME_OFFSET];
 }
 
+// looks the page up in the tlb first, and walks the page tables only when it isn't there.
+uint64_t getSuitedPAddress(uint64_t virtualAddress){
+    uint64_t pageNumber = virtualAddress >> OFFSET_WIDTH;
+    uint64_t offset = virtualAddress & (PAGE_SIZE - 1);
+    TLBEntry* entry = tlbLookup(pageNumber);
+    if (entry != nullptr) {
+        tlbStats.hits++;
+        entry->lastUse = ++tlbClock;
+        return entry->frameIndex * PAGE_SIZE + offset;
+    }
+    tlbStats.misses++;
+    uint64_t physicalAddress = walkPageTables(virtualAddress);
+    tlbInsert(pageNumber, physicalAddress / PAGE_SIZE);
+    return physicalAddress;
+}
+
 int VMread(uint64_t virtualAddress, word_t* value) {
     if(virtualAddress >= VIRTUAL_MEMORY_SIZE){
         return 0;
@@ -172,3 +265,7 @@ int VMwrite(uint64_t virtualAddress, word_t value) {
     PMwrite(getSuitedPAddress(virtualAddress), value);
     return 1;
 }
+
+void VMgetTLBStats(TLBStats* stats) {
+    *stats = tlbStats;
+}
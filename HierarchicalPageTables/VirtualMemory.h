@@ -25,4 +25,15 @@ int VMread(uint64_t virtualAddress, word_t* value);
 
 int VMwrite(uint64_t virtualAddress, word_t value);
 
+/* how many VMread and VMwrite calls found their page in the translation
+ * cache (hits) and how many walked the page tables (misses), since
+ * VMinitialize.
+ */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+} TLBStats;
+
+void VMgetTLBStats(TLBStats* stats);
+
 
@@ -1,17 +1,75 @@
 #include "Barrier.h"
 #include <cstdlib>
 #include <cstdio>
+#include <algorithm>
+#include <new>
+#include <thread>
+#include <vector>
 
-Barrier::Barrier(int numThreads)
-		: mutex(PTHREAD_MUTEX_INITIALIZER)
+/**
+ * tells the cpu that the thread is spinning.
+ */
+static inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
+
+Barrier::Barrier(int numThreads, int spinIterations)
+		: sense(0)
+		, sleepers(0)
+		, mutex(PTHREAD_MUTEX_INITIALIZER)
 		, cv(PTHREAD_COND_INITIALIZER)
-		, count(0)
 		, numThreads(numThreads)
-{ }
+		, spinIterations(spinIterations)
+{
+	if (spinIterations < 0) {
+		this->spinIterations = (numThreads <= (int) std::thread::hardware_concurrency()) ?
+		                       BARRIER_DEFAULT_SPIN_ITERATIONS : 0;
+	}
+
+	// the sizes of the levels of the tree, from the leaves to the root.
+	std::vector<int> level_sizes;
+	int children = numThreads;
+	do {
+		level_sizes.push_back((children + BARRIER_FAN_IN - 1) / BARRIER_FAN_IN);
+		children = level_sizes.back();
+	} while (children > 1);
+
+	int num_of_nodes = 0;
+	for (int level_size : level_sizes) {num_of_nodes += level_size;}
+	void* nodes_memory;
+	if (posix_memalign(&nodes_memory, BARRIER_CACHE_LINE_SIZE, num_of_nodes * sizeof(Node)) != 0) {
+		fprintf(stderr, "[[Barrier]] error on posix_memalign");
+		exit(1);
+	}
+	nodes = static_cast<Node*>(nodes_memory);
+	for (int i = 0; i < num_of_nodes; ++i) {
+		new (&nodes[i]) Node();
+	}
+	int level_start = 0;
+	children = numThreads;
+	for (size_t level = 0; level < level_sizes.size(); ++level) {
+		int next_level_start = level_start + level_sizes[level];
+		for (int j = 0; j < level_sizes[level]; ++j) {
+			Node& node = nodes[level_start + j];
+			node.count.store(0, std::memory_order_relaxed);
+			node.expected = std::min(BARRIER_FAN_IN, children - j * BARRIER_FAN_IN);
+			node.parent = (level + 1 < level_sizes.size()) ? next_level_start + j / BARRIER_FAN_IN : -1;
+		}
+		children = level_sizes[level];
+		level_start = next_level_start;
+	}
+}
 
 
 Barrier::~Barrier()
 {
+	// the nodes are trivially destructible.
+	free(nodes);
 	if (pthread_mutex_destroy(&mutex) != 0) {
 		fprintf(stderr, "[[Barrier]] error on pthread_mutex_destroy");
 		exit(1);
@@ -23,24 +81,72 @@ Barrier::~Barrier()
 }
 
 
-void Barrier::barrier()
+void Barrier::barrier(int threadId)
+{
+	// the sense can't change before this thread arrives.
+	unsigned int my_sense = sense.load(std::memory_order_acquire);
+	int node = threadId / BARRIER_FAN_IN;
+	while (node >= 0) {
+		if (nodes[node].count.fetch_add(1, std::memory_order_acq_rel) + 1 < nodes[node].expected) {
+			wait(my_sense);
+			return;
+		}
+		// the last thread to arrive at a node resets it and arrives at its parent for all of them.
+		nodes[node].count.store(0, std::memory_order_relaxed);
+		node = nodes[node].parent;
+	}
+	release(my_sense);
+}
+
+
+/**
+ * opens the barrier and wakes the threads that went to sleep waiting for it.
+ */
+void Barrier::release(unsigned int my_sense)
+{
+	sense.store(my_sense + 1, std::memory_order_seq_cst);
+	// a thread that goes to sleep after this load sees the new sense before it waits.
+	if (sleepers.load(std::memory_order_seq_cst) == 0) {
+		return;
+	}
+	if (pthread_mutex_lock(&mutex) != 0){
+		fprintf(stderr, "[[Barrier]] error on pthread_mutex_lock");
+		exit(1);
+	}
+	if (pthread_cond_broadcast(&cv) != 0) {
+		fprintf(stderr, "[[Barrier]] error on pthread_cond_broadcast");
+		exit(1);
+	}
+	if (pthread_mutex_unlock(&mutex) != 0) {
+		fprintf(stderr, "[[Barrier]] error on pthread_mutex_unlock");
+		exit(1);
+	}
+}
+
+
+/**
+ * waits until the barrier's sense is no longer my_sense, spinning first and then sleeping.
+ */
+void Barrier::wait(unsigned int my_sense)
 {
+	for (int i = 0; i < spinIterations; ++i) {
+		if (sense.load(std::memory_order_acquire) != my_sense) {
+			return;
+		}
+		cpuRelax();
+	}
 	if (pthread_mutex_lock(&mutex) != 0){
 		fprintf(stderr, "[[Barrier]] error on pthread_mutex_lock");
 		exit(1);
 	}
-	if (++count < numThreads) {
+	sleepers.fetch_add(1, std::memory_order_seq_cst);
+	while (sense.load(std::memory_order_seq_cst) == my_sense) {
 		if (pthread_cond_wait(&cv, &mutex) != 0){
 			fprintf(stderr, "[[Barrier]] error on pthread_cond_wait");
 			exit(1);
 		}
-	} else {
-		count = 0;
-		if (pthread_cond_broadcast(&cv) != 0) {
-			fprintf(stderr, "[[Barrier]] error on pthread_cond_broadcast");
-			exit(1);
-		}
 	}
+	sleepers.fetch_sub(1, std::memory_order_relaxed);
 	if (pthread_mutex_unlock(&mutex) != 0) {
 		fprintf(stderr, "[[Barrier]] error on pthread_mutex_unlock");
 		exit(1);
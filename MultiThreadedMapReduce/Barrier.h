@@ -1,20 +1,50 @@
 #ifndef BARRIER_H
 #define BARRIER_H
 #include <pthread.h>
+#include <atomic>
 
-// a multiple use barrier
+// how many times a waiting thread checks whether the barrier opened before it sleeps, when the process may
+// run all the threads of the barrier at once.
+#define BARRIER_DEFAULT_SPIN_ITERATIONS 4000
+// how many threads (or nodes of the level below) arrive at every node of the arrival tree.
+#define BARRIER_FAN_IN 4
+#define BARRIER_CACHE_LINE_SIZE 64
+
+// a multiple use barrier. the threads arrive at the leaves of a tree of counters and the last thread to
+// reach the root reverses the barrier's sense, which releases them all. a waiting thread spins on the sense
+// for a while before it sleeps on a condition variable, so a short wait costs no system call, and no counter
+// is shared by more than BARRIER_FAN_IN threads.
 
 class Barrier {
 public:
-	Barrier(int numThreads);
+	// a negative spinIterations spins BARRIER_DEFAULT_SPIN_ITERATIONS times if the process may run
+	// numThreads threads at once and not at all otherwise. 0 always sleeps right away.
+	Barrier(int numThreads, int spinIterations = -1);
 	~Barrier();
-	void barrier();
+	// every thread of the barrier passes a different threadId in [0, numThreads).
+	void barrier(int threadId);
 
 private:
+	// a counter of the arrival tree, on a cache line of its own. the nodes are allocated aligned to the
+	// line, which new doesn't do for over aligned types before c++17.
+	struct alignas(BARRIER_CACHE_LINE_SIZE) Node {
+		std::atomic<int> count;
+		int expected;
+		int parent;
+	};
+
+	void release(unsigned int my_sense);
+	void wait(unsigned int my_sense);
+
+	Node* nodes;
+	// the number of times the barrier opened, unsigned so it wraps around.
+	std::atomic<unsigned int> sense;
+	char padding[BARRIER_CACHE_LINE_SIZE - sizeof(unsigned int)];
+	std::atomic<int> sleepers;
 	pthread_mutex_t mutex;
 	pthread_cond_t cv;
-	int count;
 	int numThreads;
+	int spinIterations;
 };
 
 #endif //BARRIER_H
@@ -3,6 +3,9 @@
 
 #include <vector>  //std::vector
 #include <utility> //std::pair
+#include <string>  //std::string
+#include <cstddef> //size_t
+#include <cstdint> //uint64_t
 
 // input key and value.
 // the key, value for the map function and the MapReduceFramework
@@ -51,6 +54,60 @@ typedef std::vector<InputPair> InputVec;
 typedef std::vector<IntermediatePair> IntermediateVec;
 typedef std::vector<OutputPair> OutputVec;
 
+// a read only view of consecutive intermediate pairs that belong to the framework. it is valid only during
+// the call it is passed to.
+class IntermediateView {
+public:
+	IntermediateView(const IntermediatePair* first, size_t size) : first(first), count(size) {}
+	explicit IntermediateView(const IntermediateVec& pairs) : first(pairs.data()), count(pairs.size()) {}
+
+	const IntermediatePair* begin() const { return first; }
+	const IntermediatePair* end() const { return first + count; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	const IntermediatePair& operator[](size_t i) const { return first[i]; }
+	const IntermediatePair& front() const { return first[0]; }
+
+private:
+	const IntermediatePair* first;
+	size_t count;
+};
+
+// a record of an InputSource, which map gets as its key with a nullptr value. the bytes belong to the
+// source and are valid only during the map call.
+class InputRecord : public K1 {
+public:
+	InputRecord() : data(nullptr), size(0), offset(0) {}
+	bool operator<(const K1 &other) const { return offset < static_cast<const InputRecord&>(other).offset; }
+
+	const char* data;
+	size_t size;
+	// where the record starts in the whole input.
+	uint64_t offset;
+};
+
+// a part of an InputSource claimed by a single map thread, which reads its records one after the other.
+struct InputSplit {
+	uint64_t begin;
+	uint64_t end;
+	// where the next record of the split starts.
+	uint64_t position;
+};
+
+// an input the map threads pull their records from, instead of an InputVec that holds all of it before the
+// job starts. a source is read by a single job, and split is not called for its records.
+class InputSource {
+public:
+	virtual ~InputSource() {}
+	// the number of splits the input is cut into, the map stage's progress counts them.
+	virtual size_t numberOfSplits() const = 0;
+	// claims the next split of the input, returns false once all of them were claimed. called by all the
+	// map threads at once.
+	virtual bool claimSplit(InputSplit* split) = 0;
+	// reads the next record of a split the calling thread claimed, returns false at the end of the split.
+	virtual bool nextRecord(InputSplit* split, InputRecord* record) = 0;
+};
+
 
 class MapReduceClient {
 public:
@@ -58,10 +115,71 @@ public:
 	// number of times to output (K2, V2) pairs.
 	virtual void map(const K1* key, const V1* value, void* context) const = 0;
 
+	// optional. may split a heavy input pair into smaller input pairs, added to parts, that together map
+	// to the same intermediate pairs as the original. the parts are mapped (or split again) by any thread
+	// and must be allocated with new, the framework deletes them once they were mapped.
+	// returns false to map the pair as it is.
+	virtual bool split(const K1* key, const V1* value, InputVec& parts) const { return false; }
+
 	// gets a single K2 key and a vector of all its respective V2 values
 	// calls emit3(K3, V3, context) any number of times (usually once)
 	// to output (K3, V3) pairs.
 	virtual void reduce(const IntermediateVec* pairs, void* context) const = 0;
+
+	// the framework reduces through this function. by default it copies the pairs to a vector and calls
+	// reduce, clients that override it get the pairs without any copy (their reduce can just wrap the
+	// vector in an IntermediateView and call it).
+	virtual void reduceView(const IntermediateView& pairs, void* context) const {
+		IntermediateVec pairsVec(pairs.begin(), pairs.end());
+		reduce(&pairsVec, context);
+	}
+
+	// optional, used only when hasCombiner() returns true.
+	// gets some of the pairs of a single K2 key, all emitted by the same map thread, and calls
+	// emit2(K2, V2, context) any number of times (usually once) to output pairs that replace them.
+	// the output pairs must have a key equal to the input key. like in reduce, the input pairs are
+	// the client's to free.
+	virtual void combine(const IntermediateVec* pairs, void* context) const {}
+	virtual bool hasCombiner() const { return false; }
+
+	// optional, used only when hasAssociativeReduce() returns true.
+	// a key group much larger than the others is cut into slices that several threads reduce at once.
+	// mergeReduced then gets all the pairs the slices were reduced to (with emit3) and calls emit3 with
+	// the outputs of the whole group. like in reduce, the pairs it gets are the client's to free.
+	virtual void mergeReduced(const OutputVec* pairs, void* context) const {}
+	virtual bool hasAssociativeReduce() const { return false; }
+
+	// optional, used only when hasSerializer() returns true, by jobs that may spill pairs to disk (pairs
+	// emitted with emit2Bytes are spilled without it).
+	// serializeIntermediate appends the bytes of a pair to out, and deserializeIntermediate creates a new
+	// pair out of them. once a pair is spilled the framework deletes its key and value, so every emitted
+	// K2 and V2 must be a separate object allocated with new (or with allocateIntermediate, whose objects
+	// the framework destroys with the thread's arena).
+	// intermediateSize is the memory a pair takes, counted against the spill budget.
+	virtual void serializeIntermediate(const K2* key, const V2* value, std::string& out) const {}
+	virtual IntermediatePair deserializeIntermediate(const char* data, size_t size) const {
+		return IntermediatePair(nullptr, nullptr);
+	}
+	virtual size_t intermediateSize(const K2* key, const V2* value) const { return sizeof(IntermediatePair); }
+	virtual bool hasSerializer() const { return false; }
+
+	// optional, used only when hasKeyHash() returns true, by jobs with hashGrouping.
+	// hashIntermediateKey returns the hash of a key and intermediateKeysEqual tells whether two keys
+	// belong to the same group. equal keys must have equal hashes.
+	virtual size_t hashIntermediateKey(const K2* key) const { return 0; }
+	virtual bool intermediateKeysEqual(const K2* lhs, const K2* rhs) const {
+		return !(*lhs < *rhs) && !(*rhs < *lhs);
+	}
+	virtual bool hasKeyHash() const { return false; }
+
+	// optional, used only when hasKeyPrefix() returns true.
+	// returns 64 bits that order the keys like operator< as far as they go: if a < b then
+	// intermediateKeyPrefix(a) <= intermediateKeyPrefix(b). the framework sorts the pairs by their
+	// prefixes and compares the keys themselves only when the prefixes are equal, unless keyPrefixIsKey()
+	// returns true: then keys of equal prefixes are equal, like integer keys that fit in 64 bits.
+	virtual uint64_t intermediateKeyPrefix(const K2* key) const { return 0; }
+	virtual bool hasKeyPrefix() const { return false; }
+	virtual bool keyPrefixIsKey() const { return false; }
 };
 
 
@@ -7,138 +7,2024 @@
 #include <atomic>
 #include <algorithm>
 #include <semaphore.h>
+#include <deque>
+#include <new>
+#include <cstdint>
+#include <cstdio>
+#include <numeric>
+#include <map>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <sched.h>
+#include <dlfcn.h>
+#include <chrono>
+#include <ctime>
+#include <cerrno>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <cstring>
+#include <thread>
 
 
-typedef struct ThreadContext;
+// number of keys sampled from the sorted intermediate vectors per shuffle partition.
+#define SPLITTER_OVERSAMPLING 16
+// an intermediate vector is split into runs that any thread may sort only if it has more pairs than the
+// average, and the runs have at least this many pairs.
+#define SORT_RUN_MIN_SIZE 4096
+// pairs sorted by their key prefixes are radix sorted, unless there are fewer than this many of them.
+#define RADIX_SORT_CUTOFF 64
+// in pipelined mode, a merging thread reduces a group itself once this many groups per thread are waiting.
+#define READY_GROUPS_HIGH_WATER 4
+
+// with guided claiming, a thread claims this fraction of the remaining items divided by the number of threads.
+#define GUIDED_CLAIM_DIVISOR 2
+
+// set in reduced_pairs_atomic_counter once the job state counts the reduce stage.
+#define REDUCED_PAIRS_COUNTED_BIT (1ULL << 63)
+
+// with hashGrouping, the size of a partition's hash table starts at 2^HASH_TABLE_INITIAL_BITS slots and
+// doubles whenever more than half of them hold a group.
+#define HASH_TABLE_INITIAL_BITS 4
+// 2^64 divided by the golden ratio, spreads the key hashes over the hash table slots.
+#define HASH_SLOT_MULTIPLIER 0x9E3779B97F4A7C15ULL
+
+// the first block of a thread's arena, every next block is twice as large up to ARENA_MAX_BLOCK_SIZE.
+#define ARENA_FIRST_BLOCK_SIZE (64 * 1024)
+#define ARENA_MAX_BLOCK_SIZE (16 * 1024 * 1024)
+// the first block of the arena a merged group of pairs of bytes is read back into.
+#define GROUP_ARENA_FIRST_BLOCK_SIZE (4 * 1024)
+// for clients with an associative reduce, a group is reduced in slices by all the threads when it holds more
+// than HOT_GROUP_MIN_SIZE pairs and more than a HOT_GROUP_SHARE_DIVISOR-th of a thread's share of the pairs.
+#define HOT_GROUP_MIN_SIZE 4096
+#define HOT_GROUP_SHARE_DIVISOR 2
+
+struct ThreadContext;
+
+// with collectStats, a span of time a thread spent in one stage, in nanoseconds since the job started.
+struct TraceEvent {
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+};
+
+// an input pair the client's split produced, owned by the framework. it may be mapped by any thread.
+struct SplitPart;
+
+// an input pair that was split, done once all its parts were mapped. parent is the split pair it is a part
+// of, or nullptr for a pair of the input vector.
+struct SplitInput {
+    std::atomic<size_t> remainingParts;
+    SplitInput* parent;
+};
+
+struct SplitPart {
+    K1* key;
+    V1* value;
+    SplitInput* split;
+};
+
+// a sorted slice [begin, end) of a thread's intermediate vector, the shuffle merges the runs of all the
+// threads.
+struct SortedRun {
+    const IntermediateVec* vec;
+    size_t begin;
+    size_t end;
+};
+
+// an intermediate pair with the client's key prefix, sorted by the prefix before the key.
+struct PrefixedPair {
+    uint64_t prefix;
+    IntermediatePair pair;
+};
+
+// the memory allocateIntermediate creates a thread's objects in, and the pairs of bytes of a merged group
+// are read back into. objects are placed one after the other in the current block, and nothing is freed
+// before the whole arena is.
+struct IntermediateArena {
+    // the start of every block and its size, so the framework can tell whether an object is in the arena.
+    std::map<const char*, size_t> blocks;
+    char* position;
+    char* end;
+    size_t nextBlockSize;
+    // the objects that need their destructors run when the arena is freed, in creation order.
+    std::vector<std::pair<void*, void (*)(void*)>> destructors;
+};
+
+// a group large enough to hold the other threads up if a single thread reduced it. it is cut into slices
+// that any thread reduces, and the thread that reduces the last slice merges the outputs of all of them.
+struct HotGroup {
+    // in pipelined mode the group owns its pairs, and the bytes they were read back into from the spilled
+    // runs, until its slices were merged.
+    IntermediateVec pairs;
+    IntermediateArena pairsArena;
+    const IntermediatePair* first;
+    size_t size;
+    size_t index;
+    int numberOfSlices;
+    std::atomic<int> claimedSlices;
+    std::atomic<int> reducedSlices;
+    // the pairs the client reduced every slice to.
+    std::vector<OutputVec> sliceOutputs;
+};
+
+// a key group waiting in the ready groups queue, with its partition and its index inside the partition. the
+// group owns its pairs, and the arena the pairs of bytes read back from the spilled runs are in, so they
+// are freed as soon as it is reduced. when hotGroup is set, the entry is the given slice of that hot group
+// instead, and pairs is empty.
+struct ReadyGroup {
+    IntermediateVec pairs;
+    int partition;
+    size_t index;
+    HotGroup* hotGroup;
+    int slice;
+    IntermediateArena pairsArena;
+};
+
+// the outputs a thread emitted from the group at the given position of the key order, [start, end) of the
+// thread's output vector.
+struct OutputRun {
+    int partition;
+    size_t index;
+    size_t start;
+    size_t end;
+    int threadId;
+};
+
+// with hashGrouping, a pair emit2 routed to a hash partition, with the hash of its key.
+struct HashedPair {
+    IntermediatePair pair;
+    size_t hash;
+};
+
+// a key group found by the hash table of groupHashPartition, with its place in the shuffled pairs array.
+struct HashGroup {
+    K2* key;
+    size_t hash;
+    size_t size;
+    size_t start;
+};
 
 typedef struct {
     const MapReduceClient& client;
     const InputVec& inputVec;
+    // the source the map threads pull their records from instead of inputVec, which is then empty.
+    InputSource* inputSource;
     OutputVec& outputVec;
-    std::vector<IntermediateVec>* shuffled_vectors;
+    // the sorted runs of the intermediate vectors, partition p of run r is
+    // [partitionBounds[p][r], partitionBounds[p+1][r]).
+    std::vector<SortedRun>* sortedRuns;
+    std::vector<std::vector<size_t>>* partitionBounds;
+    // the shuffle output, the pairs of all the groups one after the other in key order. partition p is
+    // [partitionOffsets[p], partitionOffsets[p+1]) and is written by thread p.
+    IntermediatePair* shuffledPairs;
+    std::vector<size_t>* partitionOffsets;
     pthread_t* threadsPool;
     ThreadContext* threadsContexts;
+    // idle map threads wait here for split parts to steal, or for the map stage to end.
+    pthread_mutex_t mapTasksMutex;
+    pthread_cond_t mapTasksCv;
+    // counts the split parts pushed so far, under mapTasksMutex.
+    size_t mapTasksVersion;
+    Barrier* map_barrier;
     Barrier* sort_barrier;
+    Barrier* partition_barrier;
     Barrier* shuffle_barrier;
-    pthread_mutex_t percentageMutex;
-    pthread_mutex_t outputVecMutex;
     pthread_mutex_t waitMutex;
-    JobState* jobState;
+    // jobs run by a MapReduceEngine have no threads of their own, waitForJob waits for jobDone instead.
+    bool jobDone;
+    pthread_mutex_t jobDoneMutex;
+    pthread_cond_t jobDoneCv;
+    std::function<void(JobHandle)> onJobDone;
+    // the eventfd getJobEventFd made for the job, -1 until it is asked for. under jobDoneMutex.
+    int jobDoneEventFd;
+    // the job's stage and the processed and total units of the stage, in 64 bit words of their own. a stage
+    // starts once nothing adds to the previous stage's processed units, see setJobStage.
+    std::atomic<uint64_t>* job_stage_atomic;
+    std::atomic<uint64_t>* processed_atomic_counter;
+    std::atomic<uint64_t>* total_atomic_counter;
     int numberOfThreads;
+    bool collectStats;
+    // with collectStats, when the job was submitted, when its first thread started (which is later for a job
+    // that waited for the workers of an engine) and when its last thread finished.
+    uint64_t submitTime;
+    std::atomic<uint64_t> startTime;
+    uint64_t endTime;
+    size_t claimChunkSize;
+    bool pipelinedReduce;
+    size_t combineThreshold;
+    size_t spillBudget;
+    std::string spillDirectory;
+    // set when some thread spilled its pairs, then thread 0 merges all the runs and the reduce is pipelined.
+    bool mergeSpilledRuns;
+    bool deterministicOutput;
+    bool hashGrouping;
+    // set when the threads sort the runs of all the intermediate vectors together, after the map stage.
+    bool sharedSort;
+    // with pinThreads, the cpus the job's threads are pinned to, otherwise empty.
+    std::vector<int> pinnedCpus;
+    std::deque<ReadyGroup*>* readyGroups;
+    pthread_mutex_t readyGroupsMutex;
+    pthread_cond_t readyGroupsCv;
+    size_t totalIntermediatePairs;
     bool calledWait;
-    std::atomic<int>* shuffled_elements_atomic_counter;
-    std::atomic<int>* output_elements_atomic_counter;
-    std::atomic<int>* input_elements_atomic_counter;
-    std::atomic<int>* mapped_input_elements_atomic_counter;
+    // the pairs of the input vector that weren't mapped yet, including all the parts of split pairs.
+    std::atomic<int>* unfinished_inputs_atomic_counter;
+    std::atomic<uint64_t>* reduced_pairs_atomic_counter;
+    std::atomic<int>* shuffled_partitions_atomic_counter;
+    std::atomic<int>* finished_threads_atomic_counter;
 } JobContext;
 
-struct ThreadContext {
-    int threadId;
-    IntermediateVec intermediateVec;
-    JobContext* jobContext;
-};
+struct ThreadContext {
+    int threadId;
+    // with pinThreads, the thread runs on pinnedCpus[pinSlot % size].
+    unsigned int pinSlot;
+    // the part of the input vector this thread still has to map, [mapBegin, mapEnd). the thread claims from
+    // its beginning and other threads steal from its end. splitParts holds the parts of the pairs this
+    // thread split, it pops the last one and other threads steal the first one. all under mapMutex.
+    size_t mapBegin;
+    size_t mapEnd;
+    std::deque<SplitPart> splitParts;
+    pthread_mutex_t mapMutex;
+    IntermediateVec intermediateVec;
+    // where emit2 puts its pairs, this is intermediateVec except while running the client's combiner.
+    IntermediateVec* emitTarget;
+    // the number of groups of this thread's partition that were sent to the ready groups queue.
+    size_t publishedGroups;
+    // with a spill budget, the memory the client reports for the pairs in intermediateVec.
+    size_t intermediateBytes;
+    // the sorted runs of pairs this thread spilled to files, and how many pairs they hold.
+    std::vector<FILE*> spillRuns;
+    size_t spilledPairs;
+    // with sharedSort, how many of the runs of this thread's intermediateVec were claimed by some thread.
+    std::atomic<int> claimedSortRuns;
+    // the intermediateVec size from which the next combine runs during the map stage.
+    size_t nextCombineSize;
+    // set once the thread emitted a pair with emit2Bytes, then all its keys are IntermediateBytes.
+    bool emittedBytes;
+    // with hashGrouping, the pairs this thread emitted, by the partition of their key hash.
+    std::vector<std::vector<HashedPair>> hashPartitions;
+    // where each group of this thread's shuffle partition starts in the shuffled pairs array, and how many
+    // of the groups were claimed by reducing threads.
+    std::vector<size_t> groupStarts;
+    std::atomic<int> claimedGroups;
+    // the groups of the partition that aren't hot, from the largest to the smallest, and how many pairs the
+    // groups up to each of them hold. the reducing threads claim positions of groupOrder.
+    std::vector<uint32_t> groupOrder;
+    std::vector<size_t> groupOrderPairs;
+    std::vector<HotGroup*> hotGroups;
+    IntermediateArena arena;
+    // the pairs emit3 got from this thread, moved to the job's output vector when the job ends.
+    OutputVec outputVec;
+    // with deterministicOutput, where the outputs of each group this thread reduced start in outputVec.
+    std::vector<OutputRun> outputRuns;
+    ThreadStats stats;
+    std::vector<TraceEvent> traceEvents;
+    JobContext* jobContext;
+};
+
+uint64_t nowNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * with collectStats, ends the thread's span of the named stage that started at span_start, adds its length
+ * to stage_time and returns when it ended, which is where the thread's next span starts.
+ */
+uint64_t endSpan(ThreadContext* threadContext, const char* name, unsigned long long* stage_time, uint64_t span_start)
+{
+    if (!threadContext->jobContext->collectStats) {return 0;}
+    uint64_t now = nowNanoseconds();
+    *stage_time += now - span_start;
+    threadContext->traceEvents.push_back({name, span_start, now});
+    return now;
+}
+
+/**
+ * ends the thread's span of the named stage like endSpan and waits at barrier, with collectStats adding
+ * the wait to the thread's stats. returns when the wait ended.
+ */
+uint64_t waitAtBarrier(ThreadContext* threadContext, Barrier* barrier, const char* barrier_name,
+                       const char* stage_name, unsigned long long* stage_time, uint64_t span_start)
+{
+    if (!threadContext->jobContext->collectStats)
+    {
+        barrier->barrier(threadContext->threadId);
+        return 0;
+    }
+    uint64_t wait_start = endSpan(threadContext, stage_name, stage_time, span_start);
+    barrier->barrier(threadContext->threadId);
+    return endSpan(threadContext, barrier_name, &threadContext->stats.barrierWaitTime, wait_start);
+}
+
+/**
+ * locks mutex, with collectStats adding the time the thread waited for it to its stats.
+ */
+void lockJobMutex(ThreadContext* threadContext, pthread_mutex_t* mutex)
+{
+    if (!threadContext->jobContext->collectStats)
+    {
+        pthread_mutex_lock(mutex);
+        return;
+    }
+    if (pthread_mutex_trylock(mutex) == 0) {return;}
+    uint64_t wait_start = nowNanoseconds();
+    pthread_mutex_lock(mutex);
+    threadContext->stats.mutexWaitTime += nowNanoseconds() - wait_start;
+}
+
+/**
+ * waits for cv, with collectStats adding the time the thread waited for work to its stats.
+ */
+void waitForWork(ThreadContext* threadContext, pthread_cond_t* cv, pthread_mutex_t* mutex)
+{
+    if (!threadContext->jobContext->collectStats)
+    {
+        pthread_cond_wait(cv, mutex);
+        return;
+    }
+    uint64_t wait_start = nowNanoseconds();
+    pthread_cond_wait(cv, mutex);
+    threadContext->stats.idleWaitTime += nowNanoseconds() - wait_start;
+}
+
+void* allocateArenaMemory(IntermediateArena& arena, size_t size, size_t alignment)
+{
+    size_t padding = (alignment - ((uintptr_t)arena.position % alignment)) % alignment;
+    if (arena.position == nullptr || size + padding > (size_t)(arena.end - arena.position))
+    {
+        // an object larger than a quarter of a block gets a block of its own, so the current one isn't wasted.
+        bool own_block = 4 * size > arena.nextBlockSize;
+        size_t block_size = own_block ? size + alignment : arena.nextBlockSize;
+        char* block = static_cast<char*>(malloc(block_size));
+        if (block == nullptr)
+        {
+            std::cerr << "system error: malloc failed\n";
+            exit(1);
+        }
+        arena.blocks[block] = block_size;
+        padding = (alignment - ((uintptr_t)block % alignment)) % alignment;
+        if (own_block) {
+            return block + padding;
+        }
+        arena.position = block;
+        arena.end = block + block_size;
+        arena.nextBlockSize = std::min((size_t)ARENA_MAX_BLOCK_SIZE, 2 * arena.nextBlockSize);
+    }
+    void* object = arena.position + padding;
+    arena.position += padding + size;
+    return object;
+}
+
+bool arenaOwns(const IntermediateArena& arena, const void* object)
+{
+    if (arena.blocks.empty()) {return false;}
+    auto block = arena.blocks.upper_bound(static_cast<const char*>(object));
+    if (block == arena.blocks.begin()) {return false;}
+    --block;
+    return static_cast<const char*>(object) < block->first + block->second;
+}
+
+void freeArena(IntermediateArena& arena)
+{
+    for (auto destructor = arena.destructors.rbegin(); destructor != arena.destructors.rend(); ++destructor) {
+        destructor->second(destructor->first);
+    }
+    for (const auto& block : arena.blocks) {
+        free(const_cast<char*>(block.first));
+    }
+    arena.blocks.clear();
+    arena.destructors.clear();
+    arena.position = nullptr;
+    arena.end = nullptr;
+}
+
+/**
+ * destroys the objects of a thread's arena and frees its blocks, except for the block the next objects would
+ * go to, which they are placed in again from its start. used once all the thread's pairs were spilled.
+ */
+void recycleArena(IntermediateArena& arena)
+{
+    for (auto destructor = arena.destructors.rbegin(); destructor != arena.destructors.rend(); ++destructor) {
+        destructor->second(destructor->first);
+    }
+    arena.destructors.clear();
+    for (auto block = arena.blocks.begin(); block != arena.blocks.end();)
+    {
+        if (block->first + block->second == arena.end) {
+            arena.position = const_cast<char*>(block->first);
+            ++block;
+        } else {
+            free(const_cast<char*>(block->first));
+            block = arena.blocks.erase(block);
+        }
+    }
+}
+
+/**
+ * moves the job to a stage with total units to process. the counters are reset before the stage is stored,
+ * so getJobCounters, which reads the stage before and after them, never mixes the counters of two stages.
+ */
+void setJobStage(JobContext* jobContext, stage_t stage, uint64_t total)
+{
+    jobContext->processed_atomic_counter->store(0);
+    jobContext->total_atomic_counter->store(total);
+    jobContext->job_stage_atomic->store(stage);
+}
+
+void addProcessed(JobContext* jobContext, uint64_t processed)
+{
+    jobContext->processed_atomic_counter->fetch_add(processed);
+}
+
+/**
+ * counts reduced pairs. in pipelined mode groups are reduced during the shuffle as well, and until the job
+ * moves to the reduce stage they are only kept in reduced_pairs_atomic_counter, see startReduceStage.
+ */
+void addReducedPairs(JobContext* jobContext, uint64_t reduced_pairs)
+{
+    uint64_t previous = jobContext->reduced_pairs_atomic_counter->fetch_add(reduced_pairs);
+    if (previous & REDUCED_PAIRS_COUNTED_BIT) {
+        addProcessed(jobContext, reduced_pairs);
+    }
+}
+
+void startReduceStage(JobContext* jobContext)
+{
+    setJobStage(jobContext, REDUCE_STAGE, jobContext->totalIntermediatePairs);
+    // every pair reduced before this is added here, every pair reduced after it is added by its reducer.
+    uint64_t reduced_pairs = jobContext->reduced_pairs_atomic_counter->fetch_or(REDUCED_PAIRS_COUNTED_BIT);
+    addProcessed(jobContext, reduced_pairs & ~REDUCED_PAIRS_COUNTED_BIT);
+}
+
+struct MergeHead {
+    K2* key;
+    int source;
+};
+
+struct MergeHeadGreater {
+    bool operator()(const MergeHead& lhs, const MergeHead& rhs) const {return *(rhs.key) < *(lhs.key);}
+};
+
+// a sorted input of the spilled runs merge, either a run file or a thread's intermediate vector. the pairs
+// of a run of bytes are read one at a time into headWords, which keeps the object of the head pair aligned.
+struct SpillSource {
+    FILE* run;
+    const IntermediateVec* vec;
+    size_t position;
+    size_t end;
+    IntermediatePair head;
+    bool bytes;
+    std::vector<uint64_t> headWords;
+};
+
+
+/**
+ * the first 8 bytes of a key emitted with emit2Bytes, big endian and padded with zeros, which order the keys
+ * like memcmp as far as they go.
+ */
+uint64_t bytesKeyPrefix(const K2* key)
+{
+    auto bytes_key = static_cast<const IntermediateBytes*>(key);
+    uint64_t prefix = 0;
+    size_t length = std::min(bytes_key->keySize(), sizeof(prefix));
+    for (size_t i = 0; i < length; ++i) {
+        prefix |= (uint64_t)(unsigned char)bytes_key->keyData()[i] << (8 * (sizeof(prefix) - 1 - i));
+    }
+    return prefix;
+}
+
+/**
+ * the memory a pair takes, as reported by the client's intermediateSize. a pair of bytes takes its object
+ * and its bytes in the arena, and its place in the intermediate vector.
+ */
+size_t intermediatePairSize(ThreadContext* threadContext, const K2* key, const V2* value)
+{
+    if (!threadContext->emittedBytes) {
+        return threadContext->jobContext->client.intermediateSize(key, value);
+    }
+    auto bytes_pair = static_cast<const IntermediateBytes*>(key);
+    return sizeof(IntermediatePair) + sizeof(IntermediateBytes) + bytes_pair->keySize() + bytes_pair->valueSize();
+}
+
+/**
+ * whether the thread may write its pairs to run files: the job has a spill budget, and the client has a
+ * serializer or the pairs are bytes, which the framework writes itself.
+ */
+bool spillsPairs(ThreadContext* threadContext)
+{
+    return threadContext->jobContext->spillBudget > 0 &&
+           (threadContext->emittedBytes || threadContext->jobContext->client.hasSerializer());
+}
+
+/**
+ * least significant byte first radix sort of the pairs by their prefixes, skipping the bytes all the
+ * prefixes share. the pairs of equal prefixes keep their order.
+ */
+void radixSortPrefixes(std::vector<PrefixedPair>& prefixed_pairs)
+{
+    size_t n = prefixed_pairs.size();
+    std::vector<PrefixedPair> scratch(n);
+    // the counts of every byte are taken in a single pass, they don't change when the pairs are moved.
+    std::vector<size_t> byte_counts(sizeof(uint64_t) * 256, 0);
+    for (const PrefixedPair& prefixed_pair : prefixed_pairs) {
+        for (size_t byte = 0; byte < sizeof(uint64_t); ++byte) {
+            byte_counts[byte * 256 + ((prefixed_pair.prefix >> (8 * byte)) & 0xff)]++;
+        }
+    }
+    for (size_t byte = 0; byte < sizeof(uint64_t); ++byte)
+    {
+        size_t shift = 8 * byte;
+        size_t* counts = &byte_counts[byte * 256];
+        if (counts[(prefixed_pairs[0].prefix >> shift) & 0xff] == n) {
+            continue;
+        }
+        size_t position = 0;
+        for (size_t i = 0; i < 256; ++i) {
+            size_t& count = counts[i];
+            size_t bucket_size = count;
+            count = position;
+            position += bucket_size;
+        }
+        for (const PrefixedPair& prefixed_pair : prefixed_pairs) {
+            scratch[counts[(prefixed_pair.prefix >> shift) & 0xff]++] = prefixed_pair;
+        }
+        prefixed_pairs.swap(scratch);
+    }
+}
+
+/**
+ * sorts the pairs in [begin, end) by key. if the client has key prefixes, or the keys are bytes, the pairs
+ * are radix sorted by their prefixes, and the keys' operator< is only called for the pairs of equal
+ * prefixes (once per pair when their keys are already in order, like the keys of a group), or never when the
+ * prefixes are the keys.
+ */
+void sortIntermediatePairs(const MapReduceClient& client, bool bytes_keys, IntermediateVec::iterator begin,
+                           IntermediateVec::iterator end)
+{
+    if (!client.hasKeyPrefix() && !bytes_keys)
+    {
+        std::sort(begin, end, [](const IntermediatePair& lhs, const IntermediatePair& rhs)
+                  {return *(lhs.first) < *(rhs.first);});
+        return;
+    }
+    std::vector<PrefixedPair> prefixed_pairs;
+    prefixed_pairs.reserve(end - begin);
+    for (auto pair = begin; pair != end; ++pair) {
+        prefixed_pairs.push_back({bytes_keys ? bytesKeyPrefix(pair->first) : client.intermediateKeyPrefix(pair->first),
+                                  *pair});
+    }
+    auto less_key = [](const PrefixedPair& lhs, const PrefixedPair& rhs)
+                    {return *(lhs.pair.first) < *(rhs.pair.first);};
+    if (prefixed_pairs.size() < RADIX_SORT_CUTOFF)
+    {
+        std::sort(prefixed_pairs.begin(), prefixed_pairs.end(), [&less_key](const PrefixedPair& lhs,
+                                                                             const PrefixedPair& rhs)
+                  {return lhs.prefix < rhs.prefix || (lhs.prefix == rhs.prefix && less_key(lhs, rhs));});
+    }
+    else
+    {
+        radixSortPrefixes(prefixed_pairs);
+        bool prefix_is_key = !bytes_keys && client.keyPrefixIsKey();
+        auto run_start = prefixed_pairs.begin();
+        while (run_start != prefixed_pairs.end())
+        {
+            auto run_end = run_start + 1;
+            while (run_end != prefixed_pairs.end() && run_end->prefix == run_start->prefix) {run_end++;}
+            if (!prefix_is_key && !std::is_sorted(run_start, run_end, less_key)) {
+                std::sort(run_start, run_end, less_key);
+            }
+            run_start = run_end;
+        }
+    }
+    for (const PrefixedPair& prefixed_pair : prefixed_pairs) {
+        *(begin++) = prefixed_pair.pair;
+    }
+}
+
+void sortIntermediateVec(ThreadContext* threadContext)
+{
+    sortIntermediatePairs(threadContext->jobContext->client, threadContext->emittedBytes,
+                          threadContext->intermediateVec.begin(), threadContext->intermediateVec.end());
+}
+
+/**
+ * with sharedSort, the size of the runs the intermediate vectors are split into. a vector of up to the
+ * average size is a single run, so the threads only sort each other's pairs when some thread holds more.
+ */
+size_t sortRunSize(JobContext* jobContext)
+{
+    size_t total_num_of_pairs = 0;
+    for (int j = 0; j < jobContext->numberOfThreads; ++j) {
+        total_num_of_pairs += jobContext->threadsContexts[j].intermediateVec.size();
+    }
+    size_t average = (total_num_of_pairs + jobContext->numberOfThreads - 1) / jobContext->numberOfThreads;
+    return std::max((size_t)SORT_RUN_MIN_SIZE, average);
+}
+
+int numberOfSortRuns(size_t size, size_t run_size)
+{
+    return (int)((size + run_size - 1) / run_size);
+}
+
+size_t sortRunStart(size_t size, int number_of_runs, int run)
+{
+    return (size * run) / number_of_runs;
+}
+
+/**
+ * with sharedSort, sorts runs of the intermediate vectors until every run was claimed. a thread sorts the
+ * runs of its own vector first, then helps with the vectors of the other threads.
+ */
+void sortIntermediateRuns(ThreadContext* threadContext)
+{
+    JobContext* jobContext = threadContext->jobContext;
+    size_t run_size = sortRunSize(jobContext);
+    for (int k = 0; k < jobContext->numberOfThreads; ++k)
+    {
+        ThreadContext& owner = jobContext->threadsContexts[(threadContext->threadId + k) %
+                                                           jobContext->numberOfThreads];
+        IntermediateVec& vec = owner.intermediateVec;
+        int number_of_runs = numberOfSortRuns(vec.size(), run_size);
+        int run;
+        while ((run = owner.claimedSortRuns.fetch_add(1)) < number_of_runs) {
+            sortIntermediatePairs(jobContext->client, owner.emittedBytes,
+                                  vec.begin() + sortRunStart(vec.size(), number_of_runs, run),
+                                  vec.begin() + sortRunStart(vec.size(), number_of_runs, run + 1));
+        }
+    }
+}
+
+/**
+ * lists the sorted runs of all the intermediate vectors. without sharedSort every vector is one run.
+ */
+void collectSortedRuns(JobContext* jobContext)
+{
+    size_t run_size = jobContext->sharedSort ? sortRunSize(jobContext) : 0;
+    std::vector<SortedRun>& runs = *(jobContext->sortedRuns);
+    runs.clear();
+    for (int j = 0; j < jobContext->numberOfThreads; ++j)
+    {
+        const IntermediateVec& vec = jobContext->threadsContexts[j].intermediateVec;
+        if (vec.empty()) {continue;}
+        int number_of_runs = jobContext->sharedSort ? numberOfSortRuns(vec.size(), run_size) : 1;
+        for (int r = 0; r < number_of_runs; ++r) {
+            runs.push_back({&vec, sortRunStart(vec.size(), number_of_runs, r),
+                            sortRunStart(vec.size(), number_of_runs, r + 1)});
+        }
+    }
+}
+
+/**
+ * sorts the thread's intermediate pairs and replaces every run of pairs with the same key by the pairs the
+ * client's combiner emits for it. since the combiner keeps the key, the result stays sorted.
+ */
+void combineIntermediateVec(ThreadContext* threadContext)
+{
+    const MapReduceClient& client = threadContext->jobContext->client;
+    sortIntermediateVec(threadContext);
+    IntermediateVec& vec = threadContext->intermediateVec;
+    IntermediateVec combined_vec;
+    IntermediateVec same_key_vec;
+    threadContext->emitTarget = &combined_vec;
+    auto run_start = vec.begin();
+    while (run_start != vec.end())
+    {
+        auto run_end = run_start + 1;
+        while (run_end != vec.end() && !(*(run_start->first) < *(run_end->first))) {run_end++;}
+        if (run_end - run_start == 1) {
+            combined_vec.push_back(*run_start);
+        } else {
+            same_key_vec.assign(run_start, run_end);
+            client.combine(&same_key_vec, threadContext);
+        }
+        run_start = run_end;
+    }
+    threadContext->emitTarget = &vec;
+    vec.swap(combined_vec);
+
+    if (threadContext->jobContext->spillBudget > 0)
+    {
+        threadContext->intermediateBytes = 0;
+        for (const IntermediatePair& pair : vec) {
+            threadContext->intermediateBytes += intermediatePairSize(threadContext, pair.first, pair.second);
+        }
+    }
+}
+
+void writeRun(FILE* run, const void* data, size_t size)
+{
+    if (fwrite(data, 1, size, run) != size)
+    {
+        std::cerr << "system error: fwrite failed\n";
+        exit(1);
+    }
+}
+
+/**
+ * sorts the thread's intermediate pairs (combining them if the client has a combiner) and writes them to a
+ * new run file as records of a 32 bit size followed by the bytes the client serialized the pair to. pairs
+ * of bytes are written as the 32 bit sizes of their key and value followed by their bytes, straight from
+ * the arena. the spilled pairs are deleted, and the thread's arena is recycled. the file is unlinked right
+ * away, so it is gone once it is closed.
+ */
+void spillIntermediateVec(ThreadContext* threadContext)
+{
+    JobContext* jobContext = threadContext->jobContext;
+    if (jobContext->client.hasCombiner()) {
+        combineIntermediateVec(threadContext);
+    } else {
+        sortIntermediateVec(threadContext);
+    }
+
+    std::string path = jobContext->spillDirectory + "/MapReduceSpill.XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0)
+    {
+        std::cerr << "system error: mkstemp failed\n";
+        exit(1);
+    }
+    unlink(path.c_str());
+    FILE* run = fdopen(fd, "w+b");
+    if (run == nullptr)
+    {
+        std::cerr << "system error: fdopen failed\n";
+        exit(1);
+    }
+
+    std::string record;
+    for (const IntermediatePair& pair : threadContext->intermediateVec)
+    {
+        if (threadContext->emittedBytes)
+        {
+            auto bytes_pair = static_cast<const IntermediateBytes*>(pair.first);
+            uint32_t sizes[2] = {(uint32_t)bytes_pair->keySize(), (uint32_t)bytes_pair->valueSize()};
+            writeRun(run, sizes, sizeof(sizes));
+            writeRun(run, bytes_pair->keyData(), bytes_pair->keySize() + bytes_pair->valueSize());
+            continue;
+        }
+        record.clear();
+        jobContext->client.serializeIntermediate(pair.first, pair.second, record);
+        uint32_t record_size = record.size();
+        writeRun(run, &record_size, sizeof(record_size));
+        writeRun(run, record.data(), record.size());
+        if (!arenaOwns(threadContext->arena, pair.first)) {
+            delete pair.first;
+        }
+        if (!arenaOwns(threadContext->arena, pair.second)) {
+            delete pair.second;
+        }
+    }
+    if (fflush(run) != 0)
+    {
+        std::cerr << "system error: fflush failed\n";
+        exit(1);
+    }
+    threadContext->spillRuns.push_back(run);
+    threadContext->spilledPairs += threadContext->intermediateVec.size();
+    threadContext->stats.spilledPairs += threadContext->intermediateVec.size();
+    threadContext->intermediateVec.clear();
+    threadContext->intermediateBytes = 0;
+    // the thread's arena objects are all in the run now, so its memory is reused instead of growing.
+    recycleArena(threadContext->arena);
+}
+
+/**
+ * samples keys from all the sorted runs and picks numberOfThreads-1 splitters out of them, then finds for
+ * every run where each partition starts.
+ * partition p of run r is [partitionBounds[p][r], partitionBounds[p+1][r]). since the bounds are lower
+ * bounds of the same splitter in every run, all the pairs of a key end up in the same partition.
+ */
+void partitionIntermediateVectors(JobContext* jobContext)
+{
+    int numberOfThreads = jobContext->numberOfThreads;
+    const std::vector<SortedRun>& runs = *(jobContext->sortedRuns);
+    size_t samples_wanted = (size_t)numberOfThreads * SPLITTER_OVERSAMPLING;
+    size_t sample_step = std::max((size_t)1, jobContext->totalIntermediatePairs / samples_wanted);
+    std::vector<K2*> samples;
+    for (const SortedRun& run : runs) {
+        for (size_t i = run.begin + sample_step / 2; i < run.end; i += sample_step) {
+            samples.push_back((*run.vec)[i].first);
+        }
+    }
+    std::sort(samples.begin(), samples.end(), [](const K2* lhs, const K2* rhs){return *lhs < *rhs;});
+
+    std::vector<K2*> splitters;
+    for (int p = 1; p < numberOfThreads && !samples.empty(); ++p) {
+        splitters.push_back(samples[(p * samples.size()) / numberOfThreads]);
+    }
+
+    std::vector<std::vector<size_t>>& bounds = *(jobContext->partitionBounds);
+    bounds.assign(numberOfThreads + 1, std::vector<size_t>(runs.size(), 0));
+    for (size_t r = 0; r < runs.size(); ++r) {
+        const IntermediateVec& vec = *runs[r].vec;
+        bounds[0][r] = runs[r].begin;
+        for (int p = 1; p < numberOfThreads; ++p) {
+            if ((size_t)p > splitters.size()) {
+                bounds[p][r] = runs[r].end;
+                continue;
+            }
+            K2* splitter = splitters[p - 1];
+            bounds[p][r] = std::lower_bound(vec.begin() + bounds[p - 1][r], vec.begin() + runs[r].end, splitter,
+                                            [](const IntermediatePair& pair, const K2* key)
+                                            {return *(pair.first) < *key;}) - vec.begin();
+        }
+        bounds[numberOfThreads][r] = runs[r].end;
+    }
+
+    std::vector<size_t>& offsets = *(jobContext->partitionOffsets);
+    offsets.assign(numberOfThreads + 1, 0);
+    for (int p = 0; p < numberOfThreads; ++p) {
+        offsets[p + 1] = offsets[p];
+        for (size_t r = 0; r < runs.size(); ++r) {
+            offsets[p + 1] += bounds[p + 1][r] - bounds[p][r];
+        }
+    }
+    // left uninitialized, every thread constructs the pairs of its own partition. in pipelined mode every
+    // group gets a vector of its own instead, so it can be freed once it is reduced.
+    if (!jobContext->pipelinedReduce) {
+        jobContext->shuffledPairs = static_cast<IntermediatePair*>(
+                ::operator new(jobContext->totalIntermediatePairs * sizeof(IntermediatePair)));
+    }
+}
+
+/**
+ * with hashGrouping, partition p is the pairs every thread routed to hash partition p. finds where each
+ * partition starts in the shuffled pairs array.
+ */
+void partitionHashedPairs(JobContext* jobContext)
+{
+    std::vector<size_t>& offsets = *(jobContext->partitionOffsets);
+    offsets.assign(jobContext->numberOfThreads + 1, 0);
+    for (int p = 0; p < jobContext->numberOfThreads; ++p) {
+        offsets[p + 1] = offsets[p];
+        for (int j = 0; j < jobContext->numberOfThreads; ++j) {
+            offsets[p + 1] += jobContext->threadsContexts[j].hashPartitions[p].size();
+        }
+    }
+    // left uninitialized, every thread constructs the pairs of its own partition. in pipelined mode every
+    // group gets a vector of its own instead, so it can be freed once it is reduced.
+    if (!jobContext->pipelinedReduce) {
+        jobContext->shuffledPairs = static_cast<IntermediatePair*>(
+                ::operator new(jobContext->totalIntermediatePairs * sizeof(IntermediatePair)));
+    }
+}
+
+void reduceGroup(ThreadContext* threadContext, const IntermediateView& group, int partition, size_t index)
+{
+    JobContext* jobContext = threadContext->jobContext;
+    if (jobContext->deterministicOutput) {
+        threadContext->outputRuns.push_back({partition, index, threadContext->outputVec.size(), 0,
+                                             threadContext->threadId});
+    }
+    size_t outputs_before = threadContext->outputVec.size();
+    jobContext->client.reduceView(group, threadContext);
+    if (jobContext->deterministicOutput) {
+        threadContext->outputRuns.back().end = threadContext->outputVec.size();
+    }
+    threadContext->stats.reducedGroups++;
+    threadContext->stats.reducedPairs += group.size();
+    threadContext->stats.outputPairs += threadContext->outputVec.size() - outputs_before;
+
+}
+
+/**
+ * where the group at index of partition ends in the shuffled pairs array.
+ */
+size_t groupEnd(JobContext* jobContext, int partition, size_t index)
+{
+    const std::vector<size_t>& group_starts = jobContext->threadsContexts[partition].groupStarts;
+    return (index + 1 < group_starts.size()) ? group_starts[index + 1] :
+           jobContext->partitionOffsets->at(partition + 1);
+}
+
+/**
+ * whether the groups too large for one thread are cut into slices, which takes a client with an associative
+ * reduce.
+ */
+bool splitsHotGroups(JobContext* jobContext)
+{
+    return jobContext->client.hasAssociativeReduce() && jobContext->numberOfThreads > 1;
+}
+
+/**
+ * the number of pairs above which a group is a hot group.
+ */
+size_t hotGroupSize(JobContext* jobContext)
+{
+    return std::max((size_t)HOT_GROUP_MIN_SIZE, jobContext->totalIntermediatePairs /
+                    (HOT_GROUP_SHARE_DIVISOR * jobContext->numberOfThreads));
+}
+
+HotGroup* newHotGroup(JobContext* jobContext, const IntermediatePair* first, size_t size, size_t index)
+{
+    auto hot_group = new HotGroup();
+    hot_group->first = first;
+    hot_group->size = size;
+    hot_group->index = index;
+    hot_group->numberOfSlices = jobContext->numberOfThreads;
+    hot_group->claimedSlices = 0;
+    hot_group->reducedSlices = 0;
+    hot_group->sliceOutputs.resize(hot_group->numberOfSlices);
+    return hot_group;
+}
+
+/**
+ * orders the groups of the thread's shuffle partition from the largest to the smallest, so the reduce stage
+ * doesn't end with a large group that a single thread reduces while the others wait. for clients with an
+ * associative reduce, the groups too large for one thread are set aside as hot groups instead.
+ */
+void orderPartitionGroups(ThreadContext* threadContext)
+{
+    JobContext* jobContext = threadContext->jobContext;
+    int partition = threadContext->threadId;
+    const std::vector<size_t>& group_starts = threadContext->groupStarts;
+    bool split_hot_groups = splitsHotGroups(jobContext);
+    size_t hot_group_size = hotGroupSize(jobContext);
+
+    std::vector<std::pair<size_t, uint32_t>> sized_groups;
+    sized_groups.reserve(group_starts.size());
+    for (size_t index = 0; index < group_starts.size(); ++index)
+    {
+        size_t size = groupEnd(jobContext, partition, index) - group_starts[index];
+        if (!split_hot_groups || size <= hot_group_size)
+        {
+            sized_groups.push_back(std::make_pair(size, (uint32_t)index));
+            continue;
+        }
+        threadContext->hotGroups.push_back(newHotGroup(jobContext, jobContext->shuffledPairs + group_starts[index],
+                                                       size, index));
+    }
+    std::sort(sized_groups.begin(), sized_groups.end(),
+              [](const std::pair<size_t, uint32_t>& lhs, const std::pair<size_t, uint32_t>& rhs)
+              {return lhs.first > rhs.first || (lhs.first == rhs.first && lhs.second < rhs.second);});
+    size_t ordered_pairs = 0;
+    for (const std::pair<size_t, uint32_t>& group : sized_groups)
+    {
+        ordered_pairs += group.first;
+        threadContext->groupOrder.push_back(group.second);
+        threadContext->groupOrderPairs.push_back(ordered_pairs);
+    }
+}
+
+/**
+ * claims the next groups of owner's partition in its largest first order, as positions [*begin, *end) of its
+ * group order. with a fixed claimChunkSize every chunk has that many groups, otherwise the chunk holds a part
+ * of the partition's remaining pairs that shrinks as the stage nears its end, so the threads still finish
+ * together, and at least one group.
+ * returns false once every group of the partition was claimed.
+ */
+bool claimReduceGroups(JobContext* jobContext, ThreadContext& owner, int* begin, int* end)
+{
+    int total = (int)owner.groupOrder.size();
+    int chunk = (int)jobContext->claimChunkSize;
+    if (chunk == 0)
+    {
+        int position = owner.claimedGroups.load(std::memory_order_relaxed);
+        if (position >= total) {return false;}
+        size_t claimed_pairs = (position > 0) ? owner.groupOrderPairs[position - 1] : 0;
+        size_t remaining_pairs = owner.groupOrderPairs.back() - claimed_pairs;
+        size_t chunk_pairs = std::max((size_t)1,
+                                      remaining_pairs / (GUIDED_CLAIM_DIVISOR * jobContext->numberOfThreads));
+        auto chunk_end = std::upper_bound(owner.groupOrderPairs.begin() + position, owner.groupOrderPairs.end(),
+                                          claimed_pairs + chunk_pairs);
+        chunk = std::max(1, (int)(chunk_end - (owner.groupOrderPairs.begin() + position)));
+    }
+    *begin = owner.claimedGroups.fetch_add(chunk);
+    *end = std::min(*begin + chunk, total);
+    return *begin < total;
+}
+
+/**
+ * reduces a slice of a hot group of the given partition. the thread that reduces the last slice of the group
+ * has the client merge the outputs of all its slices.
+ */
+void reduceHotGroupSlice(ThreadContext* threadContext, HotGroup* hot_group, int partition, int slice)
+{
+    JobContext* jobContext = threadContext->jobContext;
+    OutputVec& outputVec = threadContext->outputVec;
+    size_t slice_begin = (hot_group->size * slice) / hot_group->numberOfSlices;
+    size_t slice_end = (hot_group->size * (slice + 1)) / hot_group->numberOfSlices;
+    size_t outputs_before = outputVec.size();
+    jobContext->client.reduceView(IntermediateView(hot_group->first + slice_begin, slice_end - slice_begin),
+                                  threadContext);
+    hot_group->sliceOutputs[slice].assign(outputVec.begin() + outputs_before, outputVec.end());
+    outputVec.resize(outputs_before);
+    threadContext->stats.reducedPairs += slice_end - slice_begin;
+    if (hot_group->reducedSlices.fetch_add(1) + 1 < hot_group->numberOfSlices) {return;}
+
+    OutputVec slices_outputs;
+    for (OutputVec& slice_outputs : hot_group->sliceOutputs)
+    {
+        slices_outputs.insert(slices_outputs.end(), slice_outputs.begin(), slice_outputs.end());
+        OutputVec().swap(slice_outputs);
+    }
+    IntermediateVec().swap(hot_group->pairs);
+    freeArena(hot_group->pairsArena);
+    if (jobContext->deterministicOutput) {
+        threadContext->outputRuns.push_back({partition, hot_group->index, outputs_before, 0,
+                                             threadContext->threadId});
+    }
+    jobContext->client.mergeReduced(&slices_outputs, threadContext);
+    if (jobContext->deterministicOutput) {
+        threadContext->outputRuns.back().end = outputVec.size();
+    }
+    threadContext->stats.reducedGroups++;
+    threadContext->stats.outputPairs += outputVec.size() - outputs_before;
+    addReducedPairs(jobContext, hot_group->size);
+}
+
+/**
+ * reduces the slices of the hot groups of every partition that no thread claimed yet.
+ */
+void reduceHotGroups(ThreadContext* threadContext)
+{
+    JobContext* jobContext = threadContext->jobContext;
+    for (int k = 0; k < jobContext->numberOfThreads; ++k)
+    {
+        int partition = (threadContext->threadId + k) % jobContext->numberOfThreads;
+        for (HotGroup* hot_group : jobContext->threadsContexts[partition].hotGroups)
+        {
+            int slice;
+            while ((slice = hot_group->claimedSlices.fetch_add(1)) < hot_group->numberOfSlices) {
+                reduceHotGroupSlice(threadContext, hot_group, partition, slice);
+            }
+        }
+    }
+}
+
+/**
+ * takes the next ready group out of the queue and reduces it. when wait is set, blocks until a group is
+ * ready or until every partition was merged.
+ * returns false if there was no group to reduce.
+ */
+bool reduceReadyGroup(ThreadContext* threadContext, bool wait)
+{
+    JobContext* jobContext = threadContext->jobContext;
+    lockJobMutex(threadContext, &jobContext->readyGroupsMutex);
+    while (wait && jobContext->readyGroups->empty() &&
+           *(jobContext->shuffled_partitions_atomic_counter) < jobContext->numberOfThreads) {
+        waitForWork(threadContext, &jobContext->readyGroupsCv, &jobContext->readyGroupsMutex);
+    }
+    if (jobContext->readyGroups->empty()) {
+        pthread_mutex_unlock(&jobContext->readyGroupsMutex);
+        return false;
+    }
+    ReadyGroup* group = jobContext->readyGroups->front();
+    jobContext->readyGroups->pop_front();
+    pthread_mutex_unlock(&jobContext->readyGroupsMutex);
+
+    if (group->hotGroup != nullptr) {
+        reduceHotGroupSlice(threadContext, group->hotGroup, group->partition, group->slice);
+    } else {
+        reduceGroup(threadContext, IntermediateView(group->pairs), group->partition, group->index);
+        addReducedPairs(jobContext, group->pairs.size());
+    }
+    freeArena(group->pairsArena);
+    delete group;
+    return true;
+}
+
+void pushReadyGroup(ThreadContext* threadContext, ReadyGroup* group)
+{
+    JobContext* jobContext = threadContext->jobContext;
+    lockJobMutex(threadContext, &jobContext->readyGroupsMutex);
+    jobContext->readyGroups->push_back(group);
+    size_t num_of_ready_groups = jobContext->readyGroups->size();
+    pthread_cond_signal(&jobContext->readyGroupsCv);
+    pthread_mutex_unlock(&jobContext->readyGroupsMutex);
+
+    // keep the queue short when every thread is still merging, so groups don't pile up in memory.
+    if (num_of_ready_groups > (size_t)jobContext->numberOfThreads * READY_GROUPS_HIGH_WATER) {
+        reduceReadyGroup(threadContext, false);
+    }
+}
+
+/**
+ * hands the complete key group that starts at start of the shuffled pairs array over to the reduce stage,
+ * which begins once the shuffle is done.
+ */
+void publishShuffledGroup(ThreadContext* threadContext, size_t start)
+{
+    threadContext->groupStarts.push_back(start);
+}
+
+/**
+ * in pipelined mode, hands a complete key group over to the ready groups queue, which takes the group's pairs,
+ * and the arena they are in when pairs_arena is given.
+ * the groups come in the order the shuffle completes them, so they can't be reduced largest first, but a hot
+ * group is still queued as slices that several threads reduce.
+ */
+void publishReadyGroup(ThreadContext* threadContext, IntermediateVec& pairs, IntermediateArena* pairs_arena)
+{
+    JobContext* jobContext = threadContext->jobContext;
+    size_t index = threadContext->publishedGroups++;
+    if (!splitsHotGroups(jobContext) || pairs.size() <= hotGroupSize(jobContext))
+    {
+        auto group = new ReadyGroup{std::move(pairs), threadContext->threadId, index, nullptr, 0};
+        if (pairs_arena != nullptr) {
+            std::swap(group->pairsArena, *pairs_arena);
+        }
+        pushReadyGroup(threadContext, group);
+        return;
+    }
+    // the thread's hot groups are deleted with the job, the pairs are freed once the slices were merged.
+    HotGroup* hot_group = newHotGroup(jobContext, nullptr, pairs.size(), index);
+    if (pairs_arena != nullptr) {
+        std::swap(hot_group->pairsArena, *pairs_arena);
+    }
+    hot_group->pairs = std::move(pairs);
+    hot_group->first = hot_group->pairs.data();
+    threadContext->hotGroups.push_back(hot_group);
+    for (int slice = 0; slice < hot_group->numberOfSlices; ++slice) {
+        pushReadyGroup(threadContext, new ReadyGroup{IntermediateVec(), threadContext->threadId, index, hot_group,
+                                                     slice});
+    }
+}
+
+/**
+ * merges this thread's partition of all the sorted runs into key groups, using a min heap holding the
+ * current head of each run slice.
+ */
+void shuffle(ThreadContext* threadContext)
+{
+    JobContext* jobContext = threadContext->jobContext;
+    const std::vector<std::vector<size_t>>& bounds = *(jobContext->partitionBounds);
+    int partition = threadContext->threadId;
+    std::vector<size_t> positions(bounds[partition]);
+    const std::vector<size_t>& ends = bounds[partition + 1];
+
+    IntermediatePair* shuffled_pairs = jobContext->shuffledPairs;
+    size_t shuffled_position = jobContext->partitionOffsets->at(partition);
+
+    const std::vector<SortedRun>& runs = *(jobContext->sortedRuns);
+    std::vector<MergeHead> heap;
+    for (size_t r = 0; r < runs.size(); ++r) {
+        if (positions[r] < ends[r]) {
+            heap.push_back({(*runs[r].vec)[positions[r]].first, (int)r});
+        }
+    }
+    std::make_heap(heap.begin(), heap.end(), MergeHeadGreater());
+
+    while (!heap.empty())
+    {
+        K2* smallest_key = heap.front().key;
+        size_t group_start = shuffled_position;
+        IntermediateVec group_pairs;
+        // pop every slice whose head equals the smallest key, and take all its pairs with that key.
+        while (!heap.empty() && !(*smallest_key < *(heap.front().key)))
+        {
+            int source = heap.front().source;
+            std::pop_heap(heap.begin(), heap.end(), MergeHeadGreater());
+            heap.pop_back();
+            const IntermediateVec& source_vec = *runs[source].vec;
+            while (positions[source] < ends[source] && !(*smallest_key < *(source_vec[positions[source]].first)))
+            {
+                if (jobContext->pipelinedReduce) {
+                    group_pairs.push_back(source_vec[positions[source]]);
+                } else {
+                    new (&shuffled_pairs[shuffled_position++]) IntermediatePair(source_vec[positions[source]]);
+                }
+                positions[source]++;
+            }
+            if (positions[source] < ends[source]) {
+                heap.push_back({source_vec[positions[source]].first, source});
+                std::push_heap(heap.begin(), heap.end(), MergeHeadGreater());
+            }
+        }
+        if (jobContext->pipelinedReduce)
+        {
+            addProcessed(jobContext, group_pairs.size());
+            publishReadyGroup(threadContext, group_pairs, nullptr);
+            continue;
+        }
+        addProcessed(jobContext, shuffled_position - group_start);
+        publishShuffledGroup(threadContext, group_start);
+    }
+}
+
+size_t hashSlot(size_t hash, int slot_bits)
+{
+    // the low bits of the hash already picked the partition, so the slot comes from the high bits of the mix.
+    return (size_t)(((uint64_t)hash * HASH_SLOT_MULTIPLIER) >> (64 - slot_bits));
+}
+
+/**
+ * doubles the hash table and puts every group back in it. a slot holds the group index plus one, 0 is empty.
+ */
+void growHashTable(std::vector<uint32_t>& slots, int* slot_bits, const std::vector<HashGroup>& groups)
+{
+    (*slot_bits)++;
+    slots.assign((size_t)1 << *slot_bits, 0);
+    for (size_t g = 0; g < groups.size(); ++g)
+    {
+        size_t slot = hashSlot(groups[g].hash, *slot_bits);
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & (slots.size() - 1);
+        }
+        slots[slot] = (uint32_t)(g + 1);
+    }
+}
+
+/**
+ * with hashGrouping, groups this thread's hash partition of all the threads' pairs by key with an open
+ * addressing hash table, then lays the groups out one after the other in the shuffled pairs array (in
+ * pipelined mode, every group in a vector of its own).
+ * nothing is sorted, except the groups themselves when the output must be deterministic.
+ */
+void groupHashPartition(ThreadContext* threadContext)
+{
+    JobContext* jobContext = threadContext->jobContext;
+    const MapReduceClient& client = jobContext->client;
+    int partition = threadContext->threadId;
+    size_t partition_start = jobContext->partitionOffsets->at(partition);
+
+    std::vector<HashGroup> groups;
+    int slot_bits = HASH_TABLE_INITIAL_BITS;
+    std::vector<uint32_t> slots((size_t)1 << slot_bits, 0);
+    // the group of every pair of the partition, in the order the pairs are read.
+    std::vector<uint32_t> pairs_groups;
+    pairs_groups.reserve(jobContext->partitionOffsets->at(partition + 1) - partition_start);
+    for (int j = 0; j < jobContext->numberOfThreads; ++j)
+    {
+        for (const HashedPair& hashed_pair : jobContext->threadsContexts[j].hashPartitions[partition])
+        {
+            size_t slot = hashSlot(hashed_pair.hash, slot_bits);
+            while (slots[slot] != 0)
+            {
+                const HashGroup& group = groups[slots[slot] - 1];
+                if (group.hash == hashed_pair.hash && client.intermediateKeysEqual(group.key,
+                                                                                   hashed_pair.pair.first)) {
+                    break;
+                }
+                slot = (slot + 1) & (slots.size() - 1);
+            }
+            uint32_t group_index = slots[slot];
+            if (group_index == 0)
+            {
+                groups.push_back({hashed_pair.pair.first, hashed_pair.hash, 0, 0});
+                group_index = (uint32_t)groups.size();
+                slots[slot] = group_index;
+                if (2 * groups.size() > slots.size()) {
+                    growHashTable(slots, &slot_bits, groups);
+                }
+            }
+            groups[group_index - 1].size++;
+            pairs_groups.push_back(group_index - 1);
+        }
+    }
+    std::vector<uint32_t>().swap(slots);
+
+    std::vector<uint32_t> groups_order(groups.size());
+    std::iota(groups_order.begin(), groups_order.end(), 0);
+    if (jobContext->deterministicOutput) {
+        std::sort(groups_order.begin(), groups_order.end(), [&groups](uint32_t lhs, uint32_t rhs)
+                  {return *(groups[lhs].key) < *(groups[rhs].key);});
+    }
+    if (jobContext->pipelinedReduce)
+    {
+        std::vector<IntermediateVec> groups_pairs(groups.size());
+        for (size_t g = 0; g < groups.size(); ++g) {
+            groups_pairs[g].reserve(groups[g].size);
+        }
+        size_t pair_index = 0;
+        for (int j = 0; j < jobContext->numberOfThreads; ++j)
+        {
+            std::vector<HashedPair>& source = jobContext->threadsContexts[j].hashPartitions[partition];
+            for (const HashedPair& hashed_pair : source) {
+                groups_pairs[pairs_groups[pair_index++]].push_back(hashed_pair.pair);
+            }
+            addProcessed(jobContext, source.size());
+            // only this thread reads its partition, so its part of every thread's pairs can go right away.
+            std::vector<HashedPair>().swap(source);
+        }
+        for (uint32_t g : groups_order) {
+            publishReadyGroup(threadContext, groups_pairs[g], nullptr);
+        }
+        return;
+    }
+
+    size_t group_start = partition_start;
+    for (uint32_t g : groups_order) {
+        groups[g].start = group_start;
+        group_start += groups[g].size;
+    }
+
+    // every group's start moves past the pairs written to it, so it ends up where the group ends.
+    IntermediatePair* shuffled_pairs = jobContext->shuffledPairs;
+    size_t pair_index = 0;
+    for (int j = 0; j < jobContext->numberOfThreads; ++j)
+    {
+        const std::vector<HashedPair>& source = jobContext->threadsContexts[j].hashPartitions[partition];
+        for (const HashedPair& hashed_pair : source) {
+            new (&shuffled_pairs[groups[pairs_groups[pair_index++]].start++]) IntermediatePair(hashed_pair.pair);
+        }
+        addProcessed(jobContext, source.size());
+    }
+    for (uint32_t g : groups_order) {
+        publishShuffledGroup(threadContext, groups[g].start - groups[g].size);
+    }
+}
+
+/**
+ * moves the outputs of all the threads to the job's output vector. by default each thread's outputs are
+ * moved as one block, with deterministicOutput they are ordered by the key order of the groups they came
+ * from, which does not depend on which thread reduced which group.
+ */
+void spliceOutputVectors(JobContext* jobContext)
+{
+    size_t total_num_of_outputs = jobContext->outputVec.size();
+    for (int j = 0; j < jobContext->numberOfThreads; ++j) {
+        total_num_of_outputs += jobContext->threadsContexts[j].outputVec.size();
+    }
+    jobContext->outputVec.reserve(total_num_of_outputs);
+
+    if (!jobContext->deterministicOutput)
+    {
+        for (int j = 0; j < jobContext->numberOfThreads; ++j) {
+            OutputVec& thread_output_vec = jobContext->threadsContexts[j].outputVec;
+            jobContext->outputVec.insert(jobContext->outputVec.end(), thread_output_vec.begin(),
+                                         thread_output_vec.end());
+            OutputVec().swap(thread_output_vec);
+        }
+        return;
+    }
+
+    std::vector<OutputRun> runs;
+    for (int j = 0; j < jobContext->numberOfThreads; ++j) {
+        runs.insert(runs.end(), jobContext->threadsContexts[j].outputRuns.begin(),
+                    jobContext->threadsContexts[j].outputRuns.end());
+    }
+    std::sort(runs.begin(), runs.end(), [](const OutputRun& lhs, const OutputRun& rhs)
+              {return lhs.partition < rhs.partition || (lhs.partition == rhs.partition && lhs.index < rhs.index);});
+    for (const OutputRun& run : runs) {
+        const OutputVec& thread_output_vec = jobContext->threadsContexts[run.threadId].outputVec;
+        jobContext->outputVec.insert(jobContext->outputVec.end(), thread_output_vec.begin() + run.start,
+                                     thread_output_vec.begin() + run.end);
+    }
+    for (int j = 0; j < jobContext->numberOfThreads; ++j) {
+        OutputVec().swap(jobContext->threadsContexts[j].outputVec);
+        std::vector<OutputRun>().swap(jobContext->threadsContexts[j].outputRuns);
+    }
+}
+
+/**
+ * moves the source to its next pair. pairs read from a run file are created by the client's
+ * deserializeIntermediate, like emitted pairs they are the client's to free. a pair of bytes is read into
+ * the source, and is only valid until the source moves again.
+ * returns false once the source is exhausted.
+ */
+bool advanceSpillSource(const MapReduceClient& client, SpillSource& source, std::string& record)
+{
+    if (source.run == nullptr)
+    {
+        if (source.position == source.end) {return false;}
+        source.head = (*source.vec)[source.position++];
+        return true;
+    }
+    uint32_t sizes[2];
+    size_t header_size = source.bytes ? sizeof(sizes) : sizeof(sizes[0]);
+    if (fread(sizes, header_size, 1, source.run) != 1)
+    {
+        if (ferror(source.run))
+        {
+            std::cerr << "system error: fread failed\n";
+            exit(1);
+        }
+        return false;
+    }
+    if (source.bytes)
+    {
+        size_t bytes_size = (size_t)sizes[0] + sizes[1];
+        source.headWords.resize((sizeof(IntermediateBytes) + bytes_size + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+        auto bytes_pair = new (source.headWords.data()) IntermediateBytes(sizes[0], sizes[1]);
+        if (fread(const_cast<char*>(bytes_pair->keyData()), 1, bytes_size, source.run) != bytes_size)
+        {
+            std::cerr << "system error: fread failed\n";
+            exit(1);
+        }
+        source.head = IntermediatePair(bytes_pair, bytes_pair);
+        return true;
+    }
+    uint32_t record_size = sizes[0];
+    record.resize(record_size);
+    if (fread(&record[0], 1, record_size, source.run) != record_size)
+    {
+        std::cerr << "system error: fread failed\n";
+        exit(1);
+    }
+    source.head = client.deserializeIntermediate(record.data(), record_size);
+    return true;
+}
+
+/**
+ * the head pair of the source, to add to a group. a pair of bytes read from a run is copied to the group's
+ * arena, since the source reads its next pair over it.
+ */
+IntermediatePair takeSpillHead(SpillSource& source, IntermediateArena& groupArena)
+{
+    if (source.run == nullptr || !source.bytes) {return source.head;}
+    auto head = static_cast<const IntermediateBytes*>(source.head.first);
+    size_t bytes_size = head->keySize() + head->valueSize();
+    auto bytes_pair = new (allocateArenaMemory(groupArena, sizeof(IntermediateBytes) + bytes_size,
+                                               alignof(IntermediateBytes)))
+            IntermediateBytes(head->keySize(), head->valueSize());
+    memcpy(const_cast<char*>(bytes_pair->keyData()), head->keyData(), bytes_size);
+    return IntermediatePair(bytes_pair, bytes_pair);
+}
+
+/**
+ * merges the spilled runs of all the threads, and the pairs the threads kept in memory, into key groups.
+ * the runs are read one record at a time and every group goes to the ready groups queue as soon as it is
+ * complete, so memory holds only the groups that wait to be reduced. pairs of bytes read from the runs are
+ * kept in an arena of their group, which is freed once the group is reduced.
+ */
+void shuffleSpilledRuns(ThreadContext* threadContext)
+{
+    JobContext* jobContext = threadContext->jobContext;
+    std::vector<SpillSource> sources;
+    for (int j = 0; j < jobContext->numberOfThreads; ++j)
+    {
+        for (FILE* run : jobContext->threadsContexts[j].spillRuns)
+        {
+            rewind(run);
+            sources.push_back({run, nullptr, 0, 0, IntermediatePair(), jobContext->threadsContexts[j].emittedBytes});
+        }
+    }
+    for (const SortedRun& run : *(jobContext->sortedRuns)) {
+        sources.push_back({nullptr, run.vec, run.begin, run.end, IntermediatePair()});
+    }
+
+    std::string record;
+    std::vector<MergeHead> heap;
+    for (int i = 0; i < (int)sources.size(); ++i) {
+        if (advanceSpillSource(jobContext->client, sources[i], record)) {
+            heap.push_back({sources[i].head.first, i});
+        }
+    }
+    std::make_heap(heap.begin(), heap.end(), MergeHeadGreater());
+
+    while (!heap.empty())
+    {
+        IntermediateVec smallest_key_vec;
+        IntermediateArena group_arena{};
+        group_arena.nextBlockSize = GROUP_ARENA_FIRST_BLOCK_SIZE;
+        // the key of the group's first pair, which stays where it is while the sources move on.
+        K2* smallest_key = nullptr;
+        while (!heap.empty() && (smallest_key == nullptr || !(*smallest_key < *(heap.front().key))))
+        {
+            SpillSource& source = sources[heap.front().source];
+            int source_index = heap.front().source;
+            std::pop_heap(heap.begin(), heap.end(), MergeHeadGreater());
+            heap.pop_back();
+            smallest_key_vec.push_back(takeSpillHead(source, group_arena));
+            smallest_key = smallest_key_vec.front().first;
+            while (advanceSpillSource(jobContext->client, source, record))
+            {
+                if (*smallest_key < *(source.head.first))
+                {
+                    heap.push_back({source.head.first, source_index});
+                    std::push_heap(heap.begin(), heap.end(), MergeHeadGreater());
+                    break;
+                }
+                smallest_key_vec.push_back(takeSpillHead(source, group_arena));
+            }
+        }
+        addProcessed(jobContext, smallest_key_vec.size());
+        publishReadyGroup(threadContext, smallest_key_vec, &group_arena);
+    }
+
+    for (int j = 0; j < jobContext->numberOfThreads; ++j)
+    {
+        for (FILE* run : jobContext->threadsContexts[j].spillRuns) {
+            fclose(run);
+        }
+        jobContext->threadsContexts[j].spillRuns.clear();
+    }
+}
+
+/**
+ * after a map call, combines or spills the thread's intermediate pairs when they grew past the job's limits.
+ */
+void checkIntermediateVec(ThreadContext* threadContext)
+{
+    JobContext* jobContext = threadContext->jobContext;
+    if (jobContext->combineThreshold > 0 && threadContext->intermediateVec.size() >= threadContext->nextCombineSize)
+    {
+        combineIntermediateVec(threadContext);
+        // when the keys hardly repeat combining again soon won't help, so wait for the buffer to double.
+        threadContext->nextCombineSize = std::max(jobContext->combineThreshold,
+                                                  2 * threadContext->intermediateVec.size());
+    }
+    if (spillsPairs(threadContext) && threadContext->intermediateBytes >= jobContext->spillBudget) {
+        spillIntermediateVec(threadContext);
+    }
+}
+
+void finishInputs(JobContext* jobContext, int finished_inputs)
+{
+    if (finished_inputs == 0) {return;}
+    addProcessed(jobContext, finished_inputs);
+    if (jobContext->unfinished_inputs_atomic_counter->fetch_sub(finished_inputs) == finished_inputs)
+    {
+        // the map stage is over, so the idle threads may stop waiting for parts to steal.
+        pthread_mutex_lock(&jobContext->mapTasksMutex);
+        pthread_cond_broadcast(&jobContext->mapTasksCv);
+        pthread_mutex_unlock(&jobContext->mapTasksMutex);
+    }
+}
+
+/**
+ * counts a mapped pair that is a part of split, or a pair of the input vector if split is nullptr.
+ * a split pair is done once all its parts are, and is then counted as a part of its own parent.
+ */
+void finishMappedPair(JobContext* jobContext, SplitInput* split)
+{
+    while (split != nullptr)
+    {
+        if (split->remainingParts.fetch_sub(1) != 1) {return;}
+        SplitInput* parent = split->parent;
+        delete split;
+        split = parent;
+    }
+    finishInputs(jobContext, 1);
+}
+
+/**
+ * adds the parts the client split a pair into to the thread's split parts, where other threads may steal
+ * them. parent is the split pair the split pair is a part of, nullptr for a pair of the input vector.
+ */
+void pushSplitParts(ThreadContext* threadContext, const InputVec& parts, SplitInput* parent)
+{
+    JobContext* jobContext = threadContext->jobContext;
+    if (parts.empty())
+    {
+        finishMappedPair(jobContext, parent);
+        return;
+    }
+    auto split = new SplitInput();
+    split->remainingParts = parts.size();
+    split->parent = parent;
+    lockJobMutex(threadContext, &threadContext->mapMutex);
+    for (const InputPair& part : parts) {
+        threadContext->splitParts.push_back({part.first, part.second, split});
+    }
+    pthread_mutex_unlock(&threadContext->mapMutex);
+
+    lockJobMutex(threadContext, &jobContext->mapTasksMutex);
+    jobContext->mapTasksVersion++;
+    pthread_cond_broadcast(&jobContext->mapTasksCv);
+    pthread_mutex_unlock(&jobContext->mapTasksMutex);
+}
+
+/**
+ * maps a single input pair, unless the client splits it. split is the split pair it is a part of, nullptr
+ * for a pair of the input vector.
+ * returns true if the pair was mapped.
+ */
+bool mapOrSplit(ThreadContext* threadContext, const K1* key, const V1* value, SplitInput* split, InputVec& parts)
+{
+    parts.clear();
+    if (threadContext->jobContext->client.split(key, value, parts))
+    {
+        pushSplitParts(threadContext, parts, split);
+        return false;
+    }
+    threadContext->jobContext->client.map(key, value, threadContext);
+    threadContext->stats.inputPairs++;
+    checkIntermediateVec(threadContext);
+    return true;
+}
+
+/**
+ * takes the thread's next map work: its last split part if it has any, otherwise a chunk of its part of
+ * the input vector, as [*begin, *end).
+ * returns false if the thread has nothing left.
+ */
+bool claimOwnMapWork(ThreadContext* threadContext, SplitPart* part, size_t* begin, size_t* end)
+{
+    JobContext* jobContext = threadContext->jobContext;
+    bool claimed = true;
+    *begin = 0;
+    *end = 0;
+    lockJobMutex(threadContext, &threadContext->mapMutex);
+    if (!threadContext->splitParts.empty())
+    {
+        *part = threadContext->splitParts.back();
+        threadContext->splitParts.pop_back();
+    }
+    else if (threadContext->mapBegin < threadContext->mapEnd)
+    {
+        size_t remaining = threadContext->mapEnd - threadContext->mapBegin;
+        size_t chunk = jobContext->claimChunkSize;
+        if (chunk == 0) {
+            chunk = std::max((size_t)1, remaining / (GUIDED_CLAIM_DIVISOR * jobContext->numberOfThreads));
+        }
+        *begin = threadContext->mapBegin;
+        *end = std::min(*begin + chunk, threadContext->mapEnd);
+        threadContext->mapBegin = *end;
+    }
+    else
+    {
+        claimed = false;
+    }
+    pthread_mutex_unlock(&threadContext->mapMutex);
+    return claimed;
+}
+
+/**
+ * gives the thread map work of another thread: the oldest split part of some thread, or else the second
+ * half of what some thread has left of its part of the input vector.
+ * returns false if no thread had work to spare.
+ */
+bool stealMapWork(ThreadContext* threadContext)
+{
+    JobContext* jobContext = threadContext->jobContext;
+    for (int k = 1; k < jobContext->numberOfThreads; ++k)
+    {
+        ThreadContext& victim = jobContext->threadsContexts[(threadContext->threadId + k) %
+                                                            jobContext->numberOfThreads];
+        lockJobMutex(threadContext, &victim.mapMutex);
+        if (victim.splitParts.empty())
+        {
+            pthread_mutex_unlock(&victim.mapMutex);
+            continue;
+        }
+        SplitPart part = victim.splitParts.front();
+        victim.splitParts.pop_front();
+        pthread_mutex_unlock(&victim.mapMutex);
+
+        lockJobMutex(threadContext, &threadContext->mapMutex);
+        threadContext->splitParts.push_back(part);
+        pthread_mutex_unlock(&threadContext->mapMutex);
+        return true;
+    }
+    for (int k = 1; k < jobContext->numberOfThreads; ++k)
+    {
+        ThreadContext& victim = jobContext->threadsContexts[(threadContext->threadId + k) %
+                                                            jobContext->numberOfThreads];
+        lockJobMutex(threadContext, &victim.mapMutex);
+        size_t remaining = victim.mapEnd - victim.mapBegin;
+        if (remaining == 0)
+        {
+            pthread_mutex_unlock(&victim.mapMutex);
+            continue;
+        }
+        size_t stolen_begin = victim.mapEnd - (remaining + 1) / 2;
+        size_t stolen_end = victim.mapEnd;
+        victim.mapEnd = stolen_begin;
+        pthread_mutex_unlock(&victim.mapMutex);
 
+        lockJobMutex(threadContext, &threadContext->mapMutex);
+        threadContext->mapBegin = stolen_begin;
+        threadContext->mapEnd = stolen_end;
+        pthread_mutex_unlock(&threadContext->mapMutex);
+        return true;
+    }
+    return false;
+}
 
-void shuffle(ThreadContext* threadContext)
+/**
+ * the map stage of a thread in a job with an input source, it maps the records of the splits it claims
+ * until all of them were claimed.
+ */
+void mapInputSource(ThreadContext* threadContext)
+{
+    JobContext* jobContext = threadContext->jobContext;
+    InputSplit split;
+    InputRecord record;
+    while (jobContext->inputSource->claimSplit(&split))
+    {
+        while (jobContext->inputSource->nextRecord(&split, &record))
+        {
+            jobContext->client.map(&record, nullptr, threadContext);
+            threadContext->stats.inputPairs++;
+            checkIntermediateVec(threadContext);
+        }
+        finishInputs(jobContext, 1);
+    }
+}
+
+/**
+ * the map stage of a thread. it maps its own part of the input vector and the parts of the pairs it split,
+ * then steals from the other threads until every input pair was mapped.
+ */
+void mapInputs(ThreadContext* threadContext)
 {
-    int total_num_of_intermediate_pairs = 0;
-    for (auto context_addr = threadContext->jobContext->threadsContexts;
-        context_addr < threadContext->jobContext->threadsContexts + threadContext->jobContext->numberOfThreads;
-        context_addr++)
+    JobContext* jobContext = threadContext->jobContext;
+    if (jobContext->inputSource != nullptr)
     {
-        total_num_of_intermediate_pairs += context_addr->intermediateVec.size();
+        mapInputSource(threadContext);
+        return;
     }
-    int total_num_of_pushed_pairs = 0;
+    InputVec parts;
     while (true)
     {
-        K2* greatest_key = nullptr;
-        for (auto context_addr = threadContext->jobContext->threadsContexts;
-            context_addr < threadContext->jobContext->threadsContexts + threadContext->jobContext->numberOfThreads;
-            context_addr++)
-        {
-            if (context_addr->intermediateVec.empty()) {continue;}
-            K2* last_key = context_addr->intermediateVec.back().first;
-            // initialize greatest_key with first last_pair.
-            if (greatest_key == nullptr) {greatest_key = last_key; continue;}
-            if (*greatest_key < *last_key) {greatest_key = last_key;}
-        }
-        if (greatest_key == nullptr) {break;}   // no more keys to pop (all intermediate vectors are empty).
-        IntermediateVec greatest_key_vec;
-        for (auto context_addr = threadContext->jobContext->threadsContexts;
-            context_addr < threadContext->jobContext->threadsContexts + threadContext->jobContext->numberOfThreads;
-            context_addr++)
-        {
-            if (context_addr->intermediateVec.empty()) {continue;}
-            IntermediatePair last_pair = context_addr->intermediateVec.back();
-            K2* last_key = last_pair.first;
-            while (!(*last_key < *greatest_key) && !(*greatest_key < *last_key))
+        SplitPart part;
+        size_t begin, end;
+        if (claimOwnMapWork(threadContext, &part, &begin, &end))
+        {
+            if (begin < end)
+            {
+                int mapped_pairs = 0;
+                for (size_t i = begin; i < end; ++i) {
+                    const InputPair& current_input_element_pair = jobContext->inputVec[i];
+                    mapped_pairs += mapOrSplit(threadContext, current_input_element_pair.first,
+                                               current_input_element_pair.second, nullptr, parts);
+                }
+                finishInputs(jobContext, mapped_pairs);
+            }
+            else
             {
-                context_addr->intermediateVec.pop_back();
-                greatest_key_vec.push_back(last_pair);
-                total_num_of_pushed_pairs += 1;
-                pthread_mutex_lock(&threadContext->jobContext->percentageMutex);
-                threadContext->jobContext->jobState->percentage =
-                        ((float)(total_num_of_pushed_pairs) / ((float) total_num_of_intermediate_pairs)) * 100;
-                pthread_mutex_unlock(&threadContext->jobContext->percentageMutex);
-                if (context_addr->intermediateVec.empty()) { break;}
-                last_pair = context_addr->intermediateVec.back();
-                last_key = last_pair.first;
+                bool mapped = mapOrSplit(threadContext, part.key, part.value, part.split, parts);
+                delete part.key;
+                delete part.value;
+                if (mapped) {
+                    finishMappedPair(jobContext, part.split);
+                }
             }
+            continue;
+        }
+
+        // a split part pushed after the version was read wakes the thread up, one pushed before it is stolen.
+        lockJobMutex(threadContext, &jobContext->mapTasksMutex);
+        size_t seen_version = jobContext->mapTasksVersion;
+        pthread_mutex_unlock(&jobContext->mapTasksMutex);
+        if (stealMapWork(threadContext)) {continue;}
+        lockJobMutex(threadContext, &jobContext->mapTasksMutex);
+        while (*(jobContext->unfinished_inputs_atomic_counter) > 0 && jobContext->mapTasksVersion == seen_version) {
+            waitForWork(threadContext, &jobContext->mapTasksCv, &jobContext->mapTasksMutex);
+        }
+        bool map_stage_done = *(jobContext->unfinished_inputs_atomic_counter) == 0;
+        pthread_mutex_unlock(&jobContext->mapTasksMutex);
+        if (map_stage_done) {return;}
+    }
+}
+
+/**
+ * the cpus the process may run on, empty if they can't be read.
+ */
+std::vector<int> allowedCpus()
+{
+    cpu_set_t allowed_cpus;
+    CPU_ZERO(&allowed_cpus);
+    std::vector<int> cpus;
+    if (sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus) != 0) {
+        return cpus;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed_cpus)) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+/**
+ * the cpus of pin_cpus the process may run on, in their order. pinning is a hint, so the others (and cpus
+ * a cpu_set_t can't hold) are dropped instead of failing the job.
+ */
+std::vector<int> validPinningCpus(const std::vector<int>& pin_cpus)
+{
+    std::vector<int> allowed_cpus = allowedCpus();
+    std::vector<int> cpus;
+    for (int cpu : pin_cpus) {
+        if (std::binary_search(allowed_cpus.begin(), allowed_cpus.end(), cpu)) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+/**
+ * the cpus pinned threads run on when the job doesn't list them: the cpus the process may run on, grouped
+ * by numa node when libnuma can be loaded, and in their own order otherwise.
+ */
+std::vector<int> defaultPinningCpus()
+{
+    std::vector<int> cpus = allowedCpus();
+
+    // libnuma is optional, so it is only looked up at run time.
+    void* numa = dlopen("libnuma.so.1", RTLD_LAZY | RTLD_LOCAL);
+    if (numa == nullptr) {
+        return cpus;
+    }
+    auto numa_available = (int (*)())dlsym(numa, "numa_available");
+    auto numa_node_of_cpu = (int (*)(int))dlsym(numa, "numa_node_of_cpu");
+    if (numa_available != nullptr && numa_node_of_cpu != nullptr && numa_available() >= 0)
+    {
+        std::vector<std::pair<int, int>> nodes_cpus;
+        for (int cpu : cpus) {
+            nodes_cpus.push_back(std::make_pair(numa_node_of_cpu(cpu), cpu));
         }
-        threadContext->jobContext->shuffled_vectors->push_back(greatest_key_vec);
+        std::sort(nodes_cpus.begin(), nodes_cpus.end());
+        for (size_t i = 0; i < cpus.size(); ++i) {
+            cpus[i] = nodes_cpus[i].second;
+        }
+    }
+    dlclose(numa);
+    return cpus;
+}
+
+/**
+ * pins the calling thread to the cpu of its pin slot, and saves the cpus it could run on before in
+ * previous_cpus. returns false, leaving the thread as it was, if the cpu can't be used (it may have gone
+ * offline since the job started).
+ */
+bool pinThread(ThreadContext* threadContext, cpu_set_t* previous_cpus)
+{
+    const std::vector<int>& cpus = threadContext->jobContext->pinnedCpus;
+    if (sched_getaffinity(0, sizeof(*previous_cpus), previous_cpus) != 0) {
+        return false;
+    }
+    cpu_set_t thread_cpus;
+    CPU_ZERO(&thread_cpus);
+    CPU_SET(cpus[threadContext->pinSlot % cpus.size()], &thread_cpus);
+    return sched_setaffinity(0, sizeof(thread_cpus), &thread_cpus) == 0;
+}
+
+/**
+ * makes the eventfd of a job readable.
+ */
+void notifyJobDone(int event_fd)
+{
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) != sizeof(one))
+    {
+        std::cerr << "system error: write failed\n";
+        exit(1);
     }
 }
 
 void* mapReduceWrapper(void* tc){
     auto threadContext = (ThreadContext*)tc;
+    JobContext* jobContext = threadContext->jobContext;
 
-    // starting map stage.
-    threadContext->jobContext->jobState->stage = MAP_STAGE;
-    int current_input_element_index = (*(threadContext->jobContext->input_elements_atomic_counter))++;
-    while (current_input_element_index < (threadContext->jobContext->inputVec.size())) {
-        InputPair current_input_element_pair = threadContext->jobContext->inputVec[current_input_element_index];
-        threadContext->jobContext->client.map(current_input_element_pair.first,
-                                              current_input_element_pair.second, threadContext);
-
-        (*(threadContext->jobContext->mapped_input_elements_atomic_counter))++;
+    // pinned before the thread allocates anything, so its buffers are first touched on its own node. the
+    // cpus are restored when the job is done, since an engine worker goes on to run other jobs.
+    cpu_set_t previous_cpus;
+    bool pinned = !jobContext->pinnedCpus.empty() && pinThread(threadContext, &previous_cpus);
+    ThreadStats& stats = threadContext->stats;
+    uint64_t span_start = jobContext->collectStats ? nowNanoseconds() : 0;
+    if (jobContext->collectStats)
+    {
+        // the earliest start of any thread, so no span of the trace starts before the job.
+        uint64_t start_time = jobContext->startTime.load();
+        while ((start_time == 0 || span_start < start_time) &&
+               !jobContext->startTime.compare_exchange_weak(start_time, span_start)) {}
+    }
 
-        pthread_mutex_lock(&threadContext->jobContext->percentageMutex);
-        threadContext->jobContext->jobState->percentage =
-                ((float)*(threadContext->jobContext->mapped_input_elements_atomic_counter) /
-                 (float)threadContext->jobContext->inputVec.size()) * 100;
-        pthread_mutex_unlock(&threadContext->jobContext->percentageMutex);
-        current_input_element_index = (*(threadContext->jobContext->input_elements_atomic_counter))++;
+    // starting map stage.
+    mapInputs(threadContext);
+    span_start = endSpan(threadContext, "map", &stats.mapTime, span_start);
+    if (jobContext->hashGrouping) {
+        // the pairs are already in their partitions, and they are grouped without sorting.
+    } else if (!threadContext->spillRuns.empty()) {
+        // the runs are merged from disk anyway, so keep the memory free for the reduce stage.
+        spillIntermediateVec(threadContext);
+    } else if (jobContext->client.hasCombiner()) {
+        combineIntermediateVec(threadContext);
     }
-    std::sort(threadContext->intermediateVec.begin(), threadContext->intermediateVec.end(),
-              [](const IntermediatePair& lhs, const IntermediatePair& rhs){return *(lhs.first) < *(rhs.first);});
 
-    threadContext->jobContext->sort_barrier->barrier();
+    if (jobContext->sharedSort)
+    {
+        // a thread that mapped many more pairs than the others would hold everyone at the sort barrier, so
+        // its vector is split into runs that idle threads help sort.
+        span_start = waitAtBarrier(threadContext, jobContext->map_barrier, "map barrier", "sort", &stats.sortTime,
+                                   span_start);
+        sortIntermediateRuns(threadContext);
+    }
+    span_start = waitAtBarrier(threadContext, jobContext->sort_barrier, "sort barrier", "sort", &stats.sortTime,
+                               span_start);
 
-    // starting shuffle stage.
+    // starting shuffle stage, each thread merges one partition of the key range.
     if (threadContext->threadId == 0)
     {
-        pthread_mutex_lock(&threadContext->jobContext->percentageMutex);
-        threadContext->jobContext->jobState->stage = SHUFFLE_STAGE;
-        threadContext->jobContext->jobState->percentage = 0.0;
-        pthread_mutex_unlock(&threadContext->jobContext->percentageMutex);
+        size_t total_num_of_intermediate_pairs = 0;
+        for (int j = 0; j < jobContext->numberOfThreads; ++j) {
+            total_num_of_intermediate_pairs += jobContext->threadsContexts[j].intermediateVec.size() +
+                                               jobContext->threadsContexts[j].spilledPairs;
+            for (const std::vector<HashedPair>& hash_partition : jobContext->threadsContexts[j].hashPartitions) {
+                total_num_of_intermediate_pairs += hash_partition.size();
+            }
+            if (!jobContext->threadsContexts[j].spillRuns.empty()) {
+                jobContext->mergeSpilledRuns = true;
+                jobContext->pipelinedReduce = true;
+            }
+        }
+        jobContext->totalIntermediatePairs = total_num_of_intermediate_pairs;
+        if (jobContext->hashGrouping) {
+            partitionHashedPairs(jobContext);
+        } else {
+            collectSortedRuns(jobContext);
+            if (!jobContext->mergeSpilledRuns) {
+                partitionIntermediateVectors(jobContext);
+            }
+        }
+        setJobStage(jobContext, SHUFFLE_STAGE, total_num_of_intermediate_pairs);
+    }
+    span_start = waitAtBarrier(threadContext, jobContext->partition_barrier, "partition barrier", "shuffle",
+                               &stats.shuffleTime, span_start);
+
+    if (jobContext->hashGrouping) {
+        groupHashPartition(threadContext);
+    } else if (!jobContext->mergeSpilledRuns) {
         shuffle(threadContext);
+    } else if (threadContext->threadId == 0) {
+        shuffleSpilledRuns(threadContext);
+    }
+    if (!jobContext->pipelinedReduce) {
+        orderPartitionGroups(threadContext);
+    }
+
+    // the last thread to finish its partition moves the job to the reduce stage, before anyone passes the
+    // barrier and starts reporting reduce progress.
+    if (++(*(jobContext->shuffled_partitions_atomic_counter)) == jobContext->numberOfThreads)
+    {
+        startReduceStage(jobContext);
+
+        if (jobContext->pipelinedReduce)
+        {
+            // nobody reads the sorted pairs anymore, and the waiting threads may stop once the queue drains.
+            for (int j = 0; j < jobContext->numberOfThreads; ++j) {
+                IntermediateVec().swap(jobContext->threadsContexts[j].intermediateVec);
+                std::vector<std::vector<HashedPair>>().swap(jobContext->threadsContexts[j].hashPartitions);
+            }
+            lockJobMutex(threadContext, &jobContext->readyGroupsMutex);
+            pthread_cond_broadcast(&jobContext->readyGroupsCv);
+            pthread_mutex_unlock(&jobContext->readyGroupsMutex);
+        }
+    }
+
+    if (jobContext->pipelinedReduce)
+    {
+        span_start = endSpan(threadContext, "shuffle", &stats.shuffleTime, span_start);
+        while (reduceReadyGroup(threadContext, true)) {}
+    }
+    else
+    {
+        span_start = waitAtBarrier(threadContext, jobContext->shuffle_barrier, "shuffle barrier", "shuffle",
+                                   &stats.shuffleTime, span_start);
+        // every partition was merged, so the sorted pairs are not needed anymore.
+        IntermediateVec().swap(threadContext->intermediateVec);
+        std::vector<std::vector<HashedPair>>().swap(threadContext->hashPartitions);
+
+        // starting reduce stage. the slices of the hot groups are the largest tasks, so they go first. then a
+        // thread reduces the groups of the partition it shuffled, which are in its cache and were first touched
+        // by it, largest first, and then helps with the other partitions.
+        reduceHotGroups(threadContext);
+        int chunk_begin, chunk_end;
+        for (int k = 0; k < jobContext->numberOfThreads; ++k)
+        {
+            int partition = (threadContext->threadId + k) % jobContext->numberOfThreads;
+            ThreadContext& owner = jobContext->threadsContexts[partition];
+            while (claimReduceGroups(jobContext, owner, &chunk_begin, &chunk_end))
+            {
+                size_t reduced_pairs = 0;
+                for (int position = chunk_begin; position < chunk_end; ++position) {
+                    size_t index = owner.groupOrder[position];
+                    size_t group_start = owner.groupStarts[index];
+                    size_t group_size = groupEnd(jobContext, partition, index) - group_start;
+                    reduceGroup(threadContext, IntermediateView(jobContext->shuffledPairs + group_start, group_size),
+                                partition, index);
+                    reduced_pairs += group_size;
+                }
+                addReducedPairs(jobContext, reduced_pairs);
+            }
+        }
+    }
+
+    span_start = endSpan(threadContext, "reduce", &stats.reduceTime, span_start);
+
+    // the last thread to finish reducing gathers every thread's outputs. once the others counted themselves
+    // the job may be released at any moment, so they must not touch it again.
+    int number_of_threads = jobContext->numberOfThreads;
+    if (++(*(jobContext->finished_threads_atomic_counter)) == number_of_threads)
+    {
+        ::operator delete(jobContext->shuffledPairs);
+        jobContext->shuffledPairs = nullptr;
+        spliceOutputVectors(jobContext);
+        jobContext->endTime = endSpan(threadContext, "output", &stats.outputTime, span_start);
+        if (jobContext->onJobDone) {
+            jobContext->onJobDone(jobContext);
+        }
+        // the job may be released as soon as this is set, so it is the last access to it.
+        pthread_mutex_lock(&jobContext->jobDoneMutex);
+        jobContext->jobDone = true;
+        if (jobContext->jobDoneEventFd >= 0) {
+            notifyJobDone(jobContext->jobDoneEventFd);
+        }
+        pthread_cond_broadcast(&jobContext->jobDoneCv);
+        pthread_mutex_unlock(&jobContext->jobDoneMutex);
     }
-    threadContext->jobContext->shuffle_barrier->barrier();
-
-    // starting reduce stage.
-    threadContext->jobContext->jobState->stage = REDUCE_STAGE;
-    threadContext->jobContext->jobState->percentage = 0.0;
-    int current_shuffled_vec_index = (*(threadContext->jobContext->shuffled_elements_atomic_counter))++;
-    while (current_shuffled_vec_index < (threadContext->jobContext->shuffled_vectors->size())) {
-        const IntermediateVec current_shuffled_element_vec =
-                threadContext->jobContext->shuffled_vectors->at(current_shuffled_vec_index);
-        threadContext->jobContext->client.reduce(&current_shuffled_element_vec, threadContext);
-        pthread_mutex_lock(&threadContext->jobContext->percentageMutex);
-        threadContext->jobContext->jobState->percentage =
-                ((float)*(threadContext->jobContext->output_elements_atomic_counter) /
-                 (float)threadContext->jobContext->shuffled_vectors->size()) * 100;
-        pthread_mutex_unlock(&threadContext->jobContext->percentageMutex);
-        current_shuffled_vec_index = (*(threadContext->jobContext->shuffled_elements_atomic_counter))++;
+    if (pinned && sched_setaffinity(0, sizeof(previous_cpus), &previous_cpus) != 0)
+    {
+        std::cerr << "system error: sched_setaffinity failed\n";
+        exit(1);
     }
     return nullptr;
 }
@@ -146,22 +2032,57 @@ void* mapReduceWrapper(void* tc){
 void releaseJobHandleResources(JobHandle job)
 {
     auto job_context = (JobContext*)job;
-    delete job_context->jobState;
+    delete job_context->job_stage_atomic;
+    delete job_context->processed_atomic_counter;
+    delete job_context->total_atomic_counter;
+    delete job_context->map_barrier;
     delete job_context->sort_barrier;
+    delete job_context->partition_barrier;
     delete job_context->shuffle_barrier;
-    delete job_context->input_elements_atomic_counter;
+    delete job_context->unfinished_inputs_atomic_counter;
+    pthread_cond_destroy(&job_context->mapTasksCv);
     delete [] job_context->threadsPool;
+    for (int i = 0; i < job_context->numberOfThreads; ++i) {
+        for (FILE* run : job_context->threadsContexts[i].spillRuns) {
+            fclose(run);
+        }
+        freeArena(job_context->threadsContexts[i].arena);
+        for (HotGroup* hot_group : job_context->threadsContexts[i].hotGroups) {
+            delete hot_group;
+        }
+    }
     delete [] job_context->threadsContexts;
-    delete job_context->shuffled_vectors;
-    delete job_context->shuffled_elements_atomic_counter;
-    delete job_context->output_elements_atomic_counter;
-    delete job_context->mapped_input_elements_atomic_counter;
+    delete job_context->sortedRuns;
+    delete job_context->partitionBounds;
+    delete job_context->partitionOffsets;
+    delete job_context->reduced_pairs_atomic_counter;
+    delete job_context->shuffled_partitions_atomic_counter;
+    delete job_context->finished_threads_atomic_counter;
+    for (ReadyGroup* group : *(job_context->readyGroups)) {
+        freeArena(group->pairsArena);
+        delete group;
+    }
+    delete job_context->readyGroups;
+    pthread_cond_destroy(&job_context->readyGroupsCv);
+    pthread_cond_destroy(&job_context->jobDoneCv);
+    if (job_context->jobDoneEventFd >= 0) {
+        close(job_context->jobDoneEventFd);
+    }
     delete job_context;
 }
 
 void waitForJob(JobHandle job)
 {
     auto job_context = (JobContext*)job;
+    if (job_context->threadsPool == nullptr)
+    {
+        pthread_mutex_lock(&job_context->jobDoneMutex);
+        while (!job_context->jobDone) {
+            pthread_cond_wait(&job_context->jobDoneCv, &job_context->jobDoneMutex);
+        }
+        pthread_mutex_unlock(&job_context->jobDoneMutex);
+        return;
+    }
     pthread_mutex_lock(&job_context->waitMutex);
     if (!(job_context->calledWait))
     {
@@ -178,13 +2099,120 @@ void waitForJob(JobHandle job)
     pthread_mutex_unlock(&job_context->waitMutex);
 }
 
+bool tryWaitForJob(JobHandle job, long timeoutMilliseconds)
+{
+    auto job_context = (JobContext*)job;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeoutMilliseconds / 1000;
+    deadline.tv_nsec += (timeoutMilliseconds % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&job_context->jobDoneMutex);
+    while (!job_context->jobDone && timeoutMilliseconds > 0)
+    {
+        int wait_res = pthread_cond_timedwait(&job_context->jobDoneCv, &job_context->jobDoneMutex, &deadline);
+        if (wait_res == ETIMEDOUT) {break;}
+    }
+    bool job_done = job_context->jobDone;
+    pthread_mutex_unlock(&job_context->jobDoneMutex);
+    // the job's threads return right after it is done, so joining them doesn't block for long.
+    if (job_done) {
+        waitForJob(job);
+    }
+    return job_done;
+}
+
+int getJobEventFd(JobHandle job)
+{
+    auto job_context = (JobContext*)job;
+    pthread_mutex_lock(&job_context->jobDoneMutex);
+    if (job_context->jobDoneEventFd < 0)
+    {
+        job_context->jobDoneEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (job_context->jobDoneEventFd < 0)
+        {
+            std::cerr << "system error: eventfd failed\n";
+            exit(1);
+        }
+        if (job_context->jobDone) {
+            notifyJobDone(job_context->jobDoneEventFd);
+        }
+    }
+    int event_fd = job_context->jobDoneEventFd;
+    pthread_mutex_unlock(&job_context->jobDoneMutex);
+    return event_fd;
+}
+
+void getJobCounters(JobHandle job, JobCounters* counters)
+{
+    auto job_context = (JobContext*)job;
+    // the stages only move forward, so an unchanged stage means both counters belong to it.
+    uint64_t stage;
+    do {
+        stage = job_context->job_stage_atomic->load();
+        counters->processed = job_context->processed_atomic_counter->load();
+        counters->total = job_context->total_atomic_counter->load();
+    } while (job_context->job_stage_atomic->load() != stage);
+    counters->stage = (stage_t)stage;
+}
+
 void getJobState(JobHandle job, JobState* state)
+{
+    JobCounters counters;
+    getJobCounters(job, &counters);
+    state->stage = counters.stage;
+    if (counters.total == 0) {
+        // nothing to process in this stage, so it is complete as soon as it starts.
+        state->percentage = (counters.stage == UNDEFINED_STAGE) ? 0.0 : 100.0;
+        return;
+    }
+    state->percentage = ((float)counters.processed / (float)counters.total) * 100;
+}
+
+void getJobStats(JobHandle job, JobStats* stats)
 {
     auto job_context = (JobContext*)job;
-    pthread_mutex_lock(&job_context->percentageMutex);
-    state->percentage = job_context->jobState->percentage;
-    state->stage = job_context->jobState->stage;
-    pthread_mutex_unlock(&job_context->percentageMutex);
+    stats->wallTime = job_context->endTime - job_context->startTime;
+    stats->queueTime = job_context->startTime - job_context->submitTime;
+    stats->threads.clear();
+    for (int i = 0; i < job_context->numberOfThreads; ++i) {
+        stats->threads.push_back(job_context->threadsContexts[i].stats);
+    }
+}
+
+void writeJobTrace(JobHandle job, const std::string& path)
+{
+    auto job_context = (JobContext*)job;
+    FILE* trace = fopen(path.c_str(), "w");
+    if (trace == nullptr)
+    {
+        std::cerr << "system error: fopen failed\n";
+        exit(1);
+    }
+    fprintf(trace, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    const char* separator = "\n";
+    for (int i = 0; i < job_context->numberOfThreads; ++i)
+    {
+        fprintf(trace, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                       "\"args\":{\"name\":\"thread %d\"}}", separator, i, i);
+        separator = ",\n";
+        // trace event times are in microseconds.
+        for (const TraceEvent& event : job_context->threadsContexts[i].traceEvents) {
+            fprintf(trace, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    separator, event.name, i, (event.start - job_context->startTime) / 1000.0,
+                    (event.end - event.start) / 1000.0);
+        }
+    }
+    fprintf(trace, "\n]}\n");
+    if (ferror(trace) || fclose(trace) != 0)
+    {
+        std::cerr << "system error: fwrite failed\n";
+        exit(1);
+    }
 }
 
 void closeJobHandle(JobHandle job)
@@ -196,45 +2224,178 @@ void closeJobHandle(JobHandle job)
 void emit2 (K2* key, V2* value, void* context)
 {
     auto threadContext = (ThreadContext*)context;
-    threadContext->intermediateVec.push_back(IntermediatePair(key, value));
+    threadContext->stats.intermediatePairs++;
+    if (threadContext->jobContext->collectStats) {
+        threadContext->stats.intermediateBytes += intermediatePairSize(threadContext, key, value);
+    }
+    if (threadContext->jobContext->hashGrouping)
+    {
+        size_t hash = threadContext->jobContext->client.hashIntermediateKey(key);
+        threadContext->hashPartitions[hash % threadContext->hashPartitions.size()].push_back(
+                {IntermediatePair(key, value), hash});
+        return;
+    }
+    threadContext->emitTarget->push_back(IntermediatePair(key, value));
+    if (threadContext->jobContext->spillBudget > 0) {
+        threadContext->intermediateBytes += intermediatePairSize(threadContext, key, value);
+    }
+}
+
+void emit2Bytes(const void* key, size_t keyLength, const void* value, size_t valueLength, void* context)
+{
+    if (keyLength > UINT32_MAX || valueLength > UINT32_MAX)
+    {
+        std::cerr << "system error: emit2Bytes got a key or a value of 4GB or more\n";
+        exit(1);
+    }
+    auto threadContext = (ThreadContext*)context;
+    threadContext->emittedBytes = true;
+    // the pair object and then its bytes, in a single piece of the arena. the object owns nothing, so it is
+    // not registered for destruction.
+    auto pair = new (allocateIntermediateMemory(context, sizeof(IntermediateBytes) + keyLength + valueLength,
+                                                alignof(IntermediateBytes))) IntermediateBytes(keyLength, valueLength);
+    char* bytes = const_cast<char*>(pair->keyData());
+    if (keyLength > 0) {
+        memcpy(bytes, key, keyLength);
+    }
+    if (valueLength > 0) {
+        memcpy(bytes + keyLength, value, valueLength);
+    }
+    emit2(pair, pair, context);
 }
 
 void emit3 (K3* key, V3* value, void* context)
 {
     auto threadContext = (ThreadContext*)context;
-    pthread_mutex_lock(&threadContext->jobContext->outputVecMutex);
-    threadContext->jobContext->outputVec.push_back(OutputPair(key, value));
-    (*(threadContext->jobContext->output_elements_atomic_counter))++;
-    pthread_mutex_unlock(&threadContext->jobContext->outputVecMutex);
+    threadContext->outputVec.push_back(OutputPair(key, value));
+}
+
+void* allocateIntermediateMemory(void* context, size_t size, size_t alignment)
+{
+    return allocateArenaMemory(((ThreadContext*)context)->arena, size, alignment);
+}
+
+void registerIntermediateDestructor(void* context, void* object, void (*destroy)(void*))
+{
+    ((ThreadContext*)context)->arena.destructors.push_back(std::make_pair(object, destroy));
 }
 
 JobHandle startMapReduceJob(const MapReduceClient& client,
                             const InputVec& inputVec, OutputVec& outputVec, int multiThreadLevel)
 {
-    auto job_context = new JobContext{client, inputVec, outputVec};
+    return startMapReduceJob(client, inputVec, outputVec, multiThreadLevel, JobOptions());
+}
+
+/**
+ * allocates a job of numberOfThreads threads and its threads contexts. the threads are not started.
+ */
+JobContext* createJobContext(const MapReduceClient& client, const InputVec& inputVec, InputSource* inputSource,
+                             OutputVec& outputVec, int multiThreadLevel, const JobOptions& options)
+{
+    auto job_context = new JobContext{client, inputVec, inputSource, outputVec};
+    // the map stage counts the input pairs, or the splits of the input source.
+    size_t num_of_inputs = (inputSource != nullptr) ? inputSource->numberOfSplits() : inputVec.size();
 
     job_context->numberOfThreads = multiThreadLevel;
-    job_context->jobState = new JobState();
-    job_context->sort_barrier = new Barrier(multiThreadLevel);
-    job_context->shuffle_barrier = new Barrier(multiThreadLevel);
-    job_context->jobState->stage = UNDEFINED_STAGE;
-    job_context->jobState->percentage = 0.0;
+    job_context->collectStats = options.collectStats;
+    job_context->submitTime = options.collectStats ? nowNanoseconds() : 0;
+    job_context->startTime = 0;
+    job_context->endTime = 0;
+    job_context->claimChunkSize = options.claimChunkSize;
+    job_context->pipelinedReduce = options.pipelinedReduce;
+    job_context->hashGrouping = client.hasKeyHash() && options.hashGrouping;
+    // a combiner needs the thread's whole vector sorted, so those threads sort on their own.
+    job_context->sharedSort = !job_context->hashGrouping && !client.hasCombiner();
+    if (options.pinThreads) {
+        job_context->pinnedCpus = options.pinCpus.empty() ? defaultPinningCpus() : validPinningCpus(options.pinCpus);
+    }
+    // jobs that run at once start at different cpus instead of all starting at the first one. an engine's
+    // workers use their own index instead.
+    static std::atomic<unsigned int> next_pin_slot(0);
+    unsigned int first_pin_slot = job_context->pinnedCpus.empty() ? 0 : next_pin_slot.fetch_add(multiThreadLevel);
+    job_context->combineThreshold = (client.hasCombiner() && !job_context->hashGrouping) ?
+                                    options.combineThreshold : 0;
+    // whether a thread's pairs can be spilled is known once it emits them, see spillsPairs.
+    job_context->spillBudget = job_context->hashGrouping ? 0 : options.spillBudget;
+    job_context->spillDirectory = options.spillDirectory;
+    job_context->mergeSpilledRuns = false;
+    job_context->deterministicOutput = options.deterministicOutput;
+    job_context->readyGroups = new std::deque<ReadyGroup*>();
+    job_context->readyGroupsMutex = PTHREAD_MUTEX_INITIALIZER;
+    job_context->readyGroupsCv = PTHREAD_COND_INITIALIZER;
+    job_context->job_stage_atomic = new std::atomic<uint64_t>(MAP_STAGE);
+    job_context->processed_atomic_counter = new std::atomic<uint64_t>(0);
+    job_context->total_atomic_counter = new std::atomic<uint64_t>(num_of_inputs);
+    job_context->map_barrier = new Barrier(multiThreadLevel, options.barrierSpinIterations);
+    job_context->sort_barrier = new Barrier(multiThreadLevel, options.barrierSpinIterations);
+    job_context->partition_barrier = new Barrier(multiThreadLevel, options.barrierSpinIterations);
+    job_context->shuffle_barrier = new Barrier(multiThreadLevel, options.barrierSpinIterations);
     job_context->calledWait = false;
-    job_context->threadsPool = new pthread_t[multiThreadLevel];
+    job_context->jobDone = false;
+    job_context->jobDoneMutex = PTHREAD_MUTEX_INITIALIZER;
+    // tryWaitForJob's deadline is on the monotonic clock, so setting the system time doesn't move it.
+    pthread_condattr_t job_done_cv_attr;
+    if (pthread_condattr_init(&job_done_cv_attr) != 0 ||
+        pthread_condattr_setclock(&job_done_cv_attr, CLOCK_MONOTONIC) != 0 ||
+        pthread_cond_init(&job_context->jobDoneCv, &job_done_cv_attr) != 0)
+    {
+        std::cerr << "system error: pthread_cond_init failed\n";
+        exit(1);
+    }
+    pthread_condattr_destroy(&job_done_cv_attr);
+    job_context->onJobDone = options.onJobDone;
+    job_context->jobDoneEventFd = -1;
+    job_context->threadsPool = nullptr;
     job_context->threadsContexts = new ThreadContext[multiThreadLevel];
-    job_context->shuffled_vectors = new std::vector<IntermediateVec>();
-    job_context->input_elements_atomic_counter = new std::atomic<int>(0);
-    job_context->output_elements_atomic_counter = new std::atomic<int>(0);
-    job_context->shuffled_elements_atomic_counter = new std::atomic<int>(0);
-    job_context->percentageMutex = PTHREAD_MUTEX_INITIALIZER;
-    job_context->outputVecMutex = PTHREAD_MUTEX_INITIALIZER;
+    job_context->sortedRuns = new std::vector<SortedRun>();
+    job_context->partitionBounds = new std::vector<std::vector<size_t>>();
+    job_context->shuffledPairs = nullptr;
+    job_context->partitionOffsets = new std::vector<size_t>();
+    job_context->totalIntermediatePairs = 0;
+    job_context->unfinished_inputs_atomic_counter = new std::atomic<int>((int)num_of_inputs);
+    job_context->mapTasksMutex = PTHREAD_MUTEX_INITIALIZER;
+    job_context->mapTasksCv = PTHREAD_COND_INITIALIZER;
+    job_context->mapTasksVersion = 0;
     job_context->waitMutex = PTHREAD_MUTEX_INITIALIZER;
-    job_context->mapped_input_elements_atomic_counter = new std::atomic<int>(0);
+    job_context->reduced_pairs_atomic_counter = new std::atomic<uint64_t>(0);
+    job_context->shuffled_partitions_atomic_counter = new std::atomic<int>(0);
+    job_context->finished_threads_atomic_counter = new std::atomic<int>(0);
 
     for (int i=0; i < multiThreadLevel; i++)
     {
         job_context->threadsContexts[i].threadId = i;
+        job_context->threadsContexts[i].pinSlot = first_pin_slot + i;
         job_context->threadsContexts[i].jobContext = job_context;
+        job_context->threadsContexts[i].emitTarget = &job_context->threadsContexts[i].intermediateVec;
+        job_context->threadsContexts[i].nextCombineSize = options.combineThreshold;
+        job_context->threadsContexts[i].emittedBytes = false;
+        job_context->threadsContexts[i].publishedGroups = 0;
+        job_context->threadsContexts[i].intermediateBytes = 0;
+        job_context->threadsContexts[i].spilledPairs = 0;
+        job_context->threadsContexts[i].claimedSortRuns = 0;
+        job_context->threadsContexts[i].claimedGroups = 0;
+        job_context->threadsContexts[i].stats = ThreadStats();
+        job_context->threadsContexts[i].mapBegin = (inputVec.size() * i) / multiThreadLevel;
+        job_context->threadsContexts[i].mapEnd = (inputVec.size() * (i + 1)) / multiThreadLevel;
+        job_context->threadsContexts[i].mapMutex = PTHREAD_MUTEX_INITIALIZER;
+        job_context->threadsContexts[i].arena.position = nullptr;
+        job_context->threadsContexts[i].arena.end = nullptr;
+        job_context->threadsContexts[i].arena.nextBlockSize = ARENA_FIRST_BLOCK_SIZE;
+        if (job_context->hashGrouping) {
+            job_context->threadsContexts[i].hashPartitions.resize(multiThreadLevel);
+        }
+    }
+    return job_context;
+}
+
+/**
+ * starts a thread of its own for every thread of the job.
+ */
+JobHandle startJobThreads(JobContext* job_context)
+{
+    job_context->threadsPool = new pthread_t[job_context->numberOfThreads];
+    for (int i=0; i < job_context->numberOfThreads; i++)
+    {
         int create_res = pthread_create(&job_context->threadsPool[i], NULL, mapReduceWrapper,
                                         &job_context->threadsContexts[i]);
         if (create_res < 0)
@@ -245,3 +2406,276 @@ JobHandle startMapReduceJob(const MapReduceClient& client,
     }
     return job_context;
 }
+
+JobHandle startMapReduceJob(const MapReduceClient& client,
+                            const InputVec& inputVec, OutputVec& outputVec, int multiThreadLevel,
+                            const JobOptions& options)
+{
+    if (options.sharedScheduler) {
+        return MapReduceEngine::shared().submitJob(client, inputVec, outputVec, multiThreadLevel, options);
+    }
+    return startJobThreads(createJobContext(client, inputVec, nullptr, outputVec, multiThreadLevel, options));
+}
+
+JobHandle startMapReduceJob(const MapReduceClient& client,
+                            InputSource& inputSource, OutputVec& outputVec, int multiThreadLevel,
+                            const JobOptions& options)
+{
+    if (options.sharedScheduler) {
+        return MapReduceEngine::shared().submitJob(client, inputSource, outputVec, multiThreadLevel, options);
+    }
+    static const InputVec no_input_pairs;
+    return startJobThreads(createJobContext(client, no_input_pairs, &inputSource, outputVec, multiThreadLevel,
+                                            options));
+}
+
+// a job submitted to a MapReduceEngine that no worker started yet. startTag is the engine's virtual time when
+// the job was submitted, and finishTag adds the job's number of inputs divided by its weight.
+struct PendingJob {
+    JobContext* job;
+    int priority;
+    double startTag;
+    double finishTag;
+    uint64_t sequence;
+};
+
+struct EngineWorkers {
+    std::vector<pthread_t> threads;
+    std::vector<PendingJob> pendingJobs;
+    // the job whose threads the workers are picking, and how many of its threads were picked.
+    JobContext* currentJob;
+    int pickedThreads;
+    // the finish tag of the last job the workers started picking, which jobs submitted now start at. it only
+    // grows, so a job that waits is passed by the jobs submitted after it only until their tags reach its own.
+    double virtualTime;
+    uint64_t submittedJobs;
+    // how many workers started, each takes the next index.
+    int startedWorkers;
+    pthread_mutex_t mutex;
+    pthread_cond_t cv;
+    bool stopping;
+};
+
+/**
+ * takes the pending job the workers pick next: the one with the highest priority, and among those the one
+ * with the earliest finish tag, so jobs of equal priority share the workers by their weights. the virtual
+ * time moves to the finish tag of the job taken (self-clocked fair queueing), so the tags of the jobs
+ * submitted later keep growing and a big job waits for a bounded amount of smaller work, not forever.
+ */
+JobContext* takeNextJob(EngineWorkers* workers)
+{
+    auto next = std::min_element(workers->pendingJobs.begin(), workers->pendingJobs.end(),
+                                 [](const PendingJob& lhs, const PendingJob& rhs)
+                                 {
+                                     if (lhs.priority != rhs.priority) {return lhs.priority > rhs.priority;}
+                                     if (lhs.finishTag != rhs.finishTag) {return lhs.finishTag < rhs.finishTag;}
+                                     return lhs.sequence < rhs.sequence;
+                                 });
+    JobContext* job = next->job;
+    workers->virtualTime = std::max(workers->virtualTime, next->finishTag);
+    workers->pendingJobs.erase(next);
+    return job;
+}
+
+/**
+ * a worker of a MapReduceEngine runs one job thread after the other. the workers pick all the threads of a
+ * job before they move to the next job, so a job that started always gets all of its threads running and
+ * its barriers never wait for threads that have no worker.
+ */
+void* engineWorker(void* ew)
+{
+    auto workers = (EngineWorkers*)ew;
+    pthread_mutex_lock(&workers->mutex);
+    int worker_index = workers->startedWorkers++;
+    pthread_mutex_unlock(&workers->mutex);
+    while (true)
+    {
+        pthread_mutex_lock(&workers->mutex);
+        while (workers->currentJob == nullptr && workers->pendingJobs.empty() && !workers->stopping) {
+            pthread_cond_wait(&workers->cv, &workers->mutex);
+        }
+        if (workers->currentJob == nullptr && workers->pendingJobs.empty()) {
+            pthread_mutex_unlock(&workers->mutex);
+            return nullptr;
+        }
+        if (workers->currentJob == nullptr) {
+            workers->currentJob = takeNextJob(workers);
+            workers->pickedThreads = 0;
+        }
+        ThreadContext* threadContext = &workers->currentJob->threadsContexts[workers->pickedThreads++];
+        if (workers->pickedThreads == workers->currentJob->numberOfThreads) {
+            workers->currentJob = nullptr;
+        }
+        pthread_mutex_unlock(&workers->mutex);
+
+        // every worker keeps to its own cpu, whichever jobs run at once.
+        threadContext->pinSlot = worker_index;
+        mapReduceWrapper(threadContext);
+    }
+}
+
+MapReduceEngine::MapReduceEngine(int numberOfWorkers)
+        : workers(new EngineWorkers())
+{
+    workers->mutex = PTHREAD_MUTEX_INITIALIZER;
+    workers->cv = PTHREAD_COND_INITIALIZER;
+    workers->stopping = false;
+    workers->currentJob = nullptr;
+    workers->pickedThreads = 0;
+    workers->virtualTime = 0;
+    workers->submittedJobs = 0;
+    workers->startedWorkers = 0;
+    workers->threads.resize(numberOfWorkers);
+    for (int i = 0; i < numberOfWorkers; ++i)
+    {
+        int create_res = pthread_create(&workers->threads[i], NULL, engineWorker, workers);
+        if (create_res < 0)
+        {
+            std::cerr << "system error: pthread_create failed\n";
+            exit(1);
+        }
+    }
+}
+
+MapReduceEngine& MapReduceEngine::shared()
+{
+    // never destroyed, so jobs may still run on it while the process exits.
+    static MapReduceEngine* engine = new MapReduceEngine(std::max(1, (int)std::thread::hardware_concurrency()));
+    return *engine;
+}
+
+MapReduceEngine::~MapReduceEngine()
+{
+    pthread_mutex_lock(&workers->mutex);
+    workers->stopping = true;
+    pthread_cond_broadcast(&workers->cv);
+    pthread_mutex_unlock(&workers->mutex);
+    for (pthread_t& thread : workers->threads)
+    {
+        int join_res = pthread_join(thread, nullptr);
+        if (join_res < 0)
+        {
+            std::cerr << "system error: pthread_join failed\n";
+            exit(1);
+        }
+    }
+    pthread_cond_destroy(&workers->cv);
+    pthread_mutex_destroy(&workers->mutex);
+    delete workers;
+}
+
+/**
+ * queues the job for the engine's workers.
+ */
+JobHandle queueJobThreads(EngineWorkers* workers, JobContext* job_context, const JobOptions& options)
+{
+    double cost = std::max(1, job_context->unfinished_inputs_atomic_counter->load());
+    double weight = (options.weight > 0) ? options.weight : 1;
+    pthread_mutex_lock(&workers->mutex);
+    workers->pendingJobs.push_back({job_context, options.priority, workers->virtualTime,
+                                    workers->virtualTime + cost / weight, workers->submittedJobs++});
+    pthread_cond_broadcast(&workers->cv);
+    pthread_mutex_unlock(&workers->mutex);
+    return job_context;
+}
+
+JobHandle MapReduceEngine::submitJob(const MapReduceClient& client, const InputVec& inputVec,
+                                     OutputVec& outputVec, int multiThreadLevel, const JobOptions& options)
+{
+    // a job's threads wait for each other at the barriers, so it can't have more of them than workers.
+    int number_of_threads = std::max(1, std::min(multiThreadLevel, (int)workers->threads.size()));
+    return queueJobThreads(workers, createJobContext(client, inputVec, nullptr, outputVec, number_of_threads,
+                                                     options), options);
+}
+
+JobHandle MapReduceEngine::submitJob(const MapReduceClient& client, InputSource& inputSource,
+                                     OutputVec& outputVec, int multiThreadLevel, const JobOptions& options)
+{
+    static const InputVec no_input_pairs;
+    int number_of_threads = std::max(1, std::min(multiThreadLevel, (int)workers->threads.size()));
+    return queueJobThreads(workers, createJobContext(client, no_input_pairs, &inputSource, outputVec,
+                                                     number_of_threads, options), options);
+}
+
+MappedFileInput::MappedFileInput(const std::string& path, char delimiter, size_t splitSize)
+        : data(nullptr)
+        , delimiter(delimiter)
+        , splitSize(std::max((size_t)1, splitSize))
+        , nextSplit(0)
+{
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0)
+    {
+        std::cerr << "system error: open failed\n";
+        exit(1);
+    }
+    size = file_stat.st_size;
+    if (size == 0) {return;}
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        std::cerr << "system error: mmap failed\n";
+        exit(1);
+    }
+    // the splits are claimed in order, so the kernel may read ahead of them.
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    data = static_cast<const char*>(mapping);
+}
+
+MappedFileInput::~MappedFileInput()
+{
+    if (data != nullptr) {
+        munmap(const_cast<char*>(data), size);
+    }
+    close(fd);
+}
+
+size_t MappedFileInput::numberOfSplits() const
+{
+    return (size + splitSize - 1) / splitSize;
+}
+
+bool MappedFileInput::claimSplit(InputSplit* split)
+{
+    size_t index = nextSplit.fetch_add(1);
+    if (index >= numberOfSplits()) {return false;}
+    split->begin = index * splitSize;
+    split->end = std::min((size_t)split->begin + splitSize, size);
+    // the record that crosses into the split belongs to the previous one, this split's first record starts
+    // after the delimiter that ends it.
+    split->position = split->begin;
+    if (split->begin > 0)
+    {
+        auto record_end = static_cast<const char*>(memchr(data + split->begin - 1, delimiter,
+                                                          size - split->begin + 1));
+        split->position = (record_end != nullptr) ? record_end - data + 1 : size;
+    }
+    return true;
+}
+
+bool MappedFileInput::nextRecord(InputSplit* split, InputRecord* record)
+{
+    if (split->position >= split->end)
+    {
+        // the pages that are only the split's leave the process' memory, a record of a neighbouring split
+        // that still reads one of them faults it back in from the file.
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t pages_begin = (split->begin + page_size - 1) / page_size * page_size;
+        size_t pages_end = split->end / page_size * page_size;
+        if (pages_begin < pages_end) {
+            madvise(const_cast<char*>(data) + pages_begin, pages_end - pages_begin, MADV_DONTNEED);
+        }
+        return false;
+    }
+    const char* record_start = data + split->position;
+    auto record_end = static_cast<const char*>(memchr(record_start, delimiter, size - split->position));
+    if (record_end == nullptr) {
+        record_end = data + size;
+    }
+    record->data = record_start;
+    record->size = record_end - record_start;
+    record->offset = split->position;
+    split->position = record_end - data + 1;
+    return true;
+}
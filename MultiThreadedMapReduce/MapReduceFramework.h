@@ -2,6 +2,15 @@
 #define MAPREDUCEFRAMEWORK_H
 
 #include "MapReduceClient.h"
+#include <cstddef>
+#include <string>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
 
 typedef void* JobHandle;
 
@@ -12,16 +21,258 @@ typedef struct {
 	float percentage;
 } JobState;
 
+// the raw progress of a job: how many units of the current stage were processed out of how many.
+// the map stage counts input pairs (or splits of an InputSource), the shuffle and reduce stages count
+// intermediate pairs.
+typedef struct {
+	stage_t stage;
+	unsigned long processed;
+	unsigned long total;
+} JobCounters;
+
+// optional settings of a job, the defaults behave like startMapReduceJob without options.
+struct JobOptions {
+	// reduce every key group as soon as the shuffle completes it, instead of waiting for the whole
+	// shuffle to finish. the reduce calls overlap with the shuffle, and every group is kept in a vector of
+	// its own that is freed as soon as it is reduced, instead of in one array of all the shuffled pairs.
+	// the groups are reduced in the order they are completed rather than largest first, but for clients with
+	// an associative reduce the groups too large for one thread are still cut into slices.
+	// the job reports the reduce stage only once the shuffle is done.
+	bool pipelinedReduce = false;
+	// for clients with a combiner, a map thread also sorts and combines its intermediate pairs whenever
+	// it holds this many of them. 0 combines only once, after the map stage.
+	size_t combineThreshold = 0;
+	// every thread keeps the pairs it emits with emit3 and they are all moved to the output vector when
+	// the job ends. by default they are added thread after thread, when this is set they are ordered by the
+	// K2 key they were reduced from, so the output is the same on every run.
+	bool deterministicOutput = false;
+	// how many input pairs (in map) or key groups (in reduce) a thread claims at once. 0 claims a part
+	// of the remaining items that shrinks towards the end of the stage, 1 claims them one at a time.
+	// in map, every thread starts with an equal part of the input and claims from it, threads that are
+	// done with theirs steal half of what another thread has left.
+	size_t claimChunkSize = 0;
+	// for clients with a serializer or that emit bytes, a map thread whose pairs take more than this many
+	// bytes (as reported by intermediateSize, or the size of the pairs of emit2Bytes) sorts them and writes
+	// them to a run file in spillDirectory. if any thread spilled, the runs are merged from disk and reduced
+	// as they are merged, like with pipelinedReduce (in the order they are merged, with the large groups of
+	// an associative reduce cut into slices). 0 never spills.
+	size_t spillBudget = 0;
+	std::string spillDirectory = "/tmp";
+	// for clients with a key hash, group the intermediate pairs by hashing their keys instead of sorting
+	// them. emit2 puts every pair in the partition of its hash and each thread groups one partition with a
+	// hash table, so the groups are reduced in no particular order (with deterministicOutput, the groups of
+	// each partition are sorted by key). the combiner and the spill budget are not used in this mode.
+	bool hashGrouping = false;
+	// pin every thread of the job to a single cpu while it runs the job, so the pairs it emits and the
+	// partition it shuffles stay in the memory of its numa node. when pinCpus is empty, the cpus the process
+	// may run on are used, grouped by numa node if libnuma is installed so threads with close ids share a
+	// node. the threads take consecutive cpus of the list, starting after the ones the previous pinned jobs
+	// took, and the workers of a MapReduceEngine each keep to the cpu of their own index. cpus the process
+	// may not run on are dropped from pinCpus, and a thread whose cpu can't be used isn't pinned.
+	bool pinThreads = false;
+	std::vector<int> pinCpus;
+	// measure every thread of the job for getJobStats and writeJobTrace. jobs without it only pay for a
+	// few checks of this flag.
+	bool collectStats = false;
+	// how many times a thread that waits for the others between two stages checks whether they are done
+	// before it sleeps. a negative value spins only if the process may run all the job's threads at once,
+	// 0 always sleeps right away.
+	int barrierSpinIterations = -1;
+	// called once the job is done and its outputs are in the output vector, by the job's last thread. it
+	// may look at the job (with getJobState, getJobStats...) but must not wait for it or close it.
+	std::function<void(JobHandle)> onJobDone;
+	// run the job on the process' shared MapReduceEngine instead of threads of its own, so the jobs that
+	// run at once share a worker for every cpu instead of oversubscribing them.
+	bool sharedScheduler = false;
+	// for jobs run by a MapReduceEngine. the workers start the pending job with the highest priority, so a
+	// job waits for as long as jobs of a higher priority keep coming. jobs of equal priority share the
+	// workers by weight (fair queueing): a job's number of inputs divided by its weight is its cost, and it
+	// is started once the jobs started after its submission cost about as much as it does. so a big job
+	// waits behind a bounded amount of smaller jobs, and a job of weight 2 gets twice the share of one of 1.
+	int priority = 0;
+	double weight = 1;
+};
+
+// what a thread of a job with collectStats did, times are in nanoseconds. the stage times include the
+// mutex and idle waits inside the stage, but not the barrier waits.
+typedef struct {
+	// mapping its input pairs and the parts of split pairs.
+	unsigned long long mapTime;
+	// sorting, combining or spilling its pairs after the map stage, and helping other threads sort.
+	unsigned long long sortTime;
+	// partitioning (thread 0) and merging or hash grouping its shuffle partition.
+	unsigned long long shuffleTime;
+	unsigned long long reduceTime;
+	// moving all the outputs to the output vector, done by the last thread to finish.
+	unsigned long long outputTime;
+	// waiting at the barriers between the stages.
+	unsigned long long barrierWaitTime;
+	// waiting to lock the job's mutexes.
+	unsigned long long mutexWaitTime;
+	// waiting for work other threads hand out, split parts to steal and ready groups in pipelined mode.
+	unsigned long long idleWaitTime;
+	unsigned long inputPairs;
+	unsigned long intermediatePairs;
+	// the memory of the pairs emitted with emit2, as reported by the client's intermediateSize, or the
+	// memory the pairs of emit2Bytes take.
+	unsigned long long intermediateBytes;
+	unsigned long spilledPairs;
+	unsigned long reducedGroups;
+	unsigned long reducedPairs;
+	unsigned long outputPairs;
+} ThreadStats;
+
+struct JobStats {
+	// from the start of the job's first thread until its last thread finished.
+	unsigned long long wallTime;
+	// from starting the job until its first thread started, the time it waited for the workers of a
+	// MapReduceEngine.
+	unsigned long long queueTime;
+	std::vector<ThreadStats> threads;
+};
+
 void emit2 (K2* key, V2* value, void* context);
 void emit3 (K3* key, V3* value, void* context);
 
+// every thread of a job has an arena the client can create its K2 and V2 objects in, through the context
+// map, combine and reduce get. the arena is freed as a whole when the job handle is closed, running the
+// destructors of its objects in the reverse order of their creation. objects created in the arena must not
+// be deleted by the client and must not be used after closeJobHandle, so the outputs passed to emit3 can't
+// come from it. when a map thread spills its pairs, its arena is freed the same way and reused, so in a job
+// with a spill budget the arena objects of map and combine may only be referenced by the pairs they emit.
+void* allocateIntermediateMemory(void* context, size_t size, size_t alignment);
+void registerIntermediateDestructor(void* context, void* object, void (*destroy)(void*));
+
+template <class T>
+void destroyIntermediate(void* object)
+{
+	static_cast<T*>(object)->~T();
+}
+
+template <class T, class... Args>
+T* allocateIntermediate(void* context, Args&&... args)
+{
+	T* object = new (allocateIntermediateMemory(context, sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+	if (!std::is_trivially_destructible<T>::value) {
+		registerIntermediateDestructor(context, object, &destroyIntermediate<T>);
+	}
+	return object;
+}
+
+// a pair emitted with emit2Bytes. its key and its value are the same object, so pair.first and pair.second
+// both cast to it, and it is followed by the key bytes and then the value bytes. keys compare their bytes
+// like memcmp, and a key that is a prefix of another comes first. the pairs belong to the framework, the
+// client never deletes them.
+class IntermediateBytes : public K2, public V2 {
+public:
+	IntermediateBytes(uint32_t keySize, uint32_t valueSize) : keyLength(keySize), valueLength(valueSize) {}
+	bool operator<(const K2 &other) const {
+		const IntermediateBytes& rhs = static_cast<const IntermediateBytes&>(other);
+		int order = memcmp(keyData(), rhs.keyData(), std::min(keyLength, rhs.keyLength));
+		return order < 0 || (order == 0 && keyLength < rhs.keyLength);
+	}
+	const char* keyData() const { return reinterpret_cast<const char*>(this + 1); }
+	size_t keySize() const { return keyLength; }
+	const char* valueData() const { return keyData() + keyLength; }
+	size_t valueSize() const { return valueLength; }
+
+private:
+	uint32_t keyLength;
+	uint32_t valueLength;
+};
+
+// emits a pair of bytes instead of K2 and V2 objects. the pair and its bytes are copied to the thread's
+// arena in one piece, so it costs no allocation of its own, and the pairs are sorted by the first bytes
+// of their keys before memcmp is called. reduce and combine get the pairs as IntermediateBytes. a client
+// that emits bytes must emit all its pairs this way, and its keys and values must be shorter than 4GB.
+// with a spill budget such pairs are spilled and read back by the framework, the client's serializer isn't
+// used, and its key hash (if it has one) gets IntermediateBytes as well.
+void emit2Bytes(const void* key, size_t keyLength, const void* value, size_t valueLength, void* context);
+
 JobHandle startMapReduceJob(const MapReduceClient& client,
 	const InputVec& inputVec, OutputVec& outputVec,
 	int multiThreadLevel);
 
+JobHandle startMapReduceJob(const MapReduceClient& client,
+	const InputVec& inputVec, OutputVec& outputVec,
+	int multiThreadLevel, const JobOptions& options);
+
+// runs a job whose map threads pull their records from inputSource, which must outlive the job.
+JobHandle startMapReduceJob(const MapReduceClient& client,
+	InputSource& inputSource, OutputVec& outputVec,
+	int multiThreadLevel, const JobOptions& options = JobOptions());
+
+// the size of a split of a MappedFileInput, unless it is given another one.
+#define DEFAULT_INPUT_SPLIT_SIZE (4 * 1024 * 1024)
+
+// an InputSource over a memory mapped file, whose records are the bytes between delimiters (lines, by
+// default). the file is cut into splits of splitSize bytes and a record belongs to the split it starts in,
+// so the map stage starts right away and the pages of a split are dropped from the process once it was read.
+class MappedFileInput : public InputSource {
+public:
+	explicit MappedFileInput(const std::string& path, char delimiter = '\n',
+		size_t splitSize = DEFAULT_INPUT_SPLIT_SIZE);
+	~MappedFileInput();
+	MappedFileInput(const MappedFileInput&) = delete;
+	MappedFileInput& operator=(const MappedFileInput&) = delete;
+
+	size_t numberOfSplits() const;
+	bool claimSplit(InputSplit* split);
+	bool nextRecord(InputSplit* split, InputRecord* record);
+
+private:
+	int fd;
+	const char* data;
+	size_t size;
+	char delimiter;
+	size_t splitSize;
+	std::atomic<size_t> nextSplit;
+};
+
+struct EngineWorkers;
+
+// runs map reduce jobs on a pool of worker threads that lives as long as the engine, so jobs don't pay for
+// creating and joining threads. any number of jobs may be in flight, each job runs on min(multiThreadLevel,
+// numberOfWorkers) of the workers, which start all the threads of a job before they move to the next one.
+// the returned handles are used like the ones startMapReduceJob returns, and must be closed before the
+// engine is destroyed. the pending jobs are started by their priority and weight, see JobOptions.
+class MapReduceEngine {
+public:
+	explicit MapReduceEngine(int numberOfWorkers);
+	// the engine of the jobs started with sharedScheduler, with a worker for every cpu. it is created on
+	// first use and is never destroyed.
+	static MapReduceEngine& shared();
+	~MapReduceEngine();
+	MapReduceEngine(const MapReduceEngine&) = delete;
+	MapReduceEngine& operator=(const MapReduceEngine&) = delete;
+
+	JobHandle submitJob(const MapReduceClient& client,
+		const InputVec& inputVec, OutputVec& outputVec,
+		int multiThreadLevel, const JobOptions& options = JobOptions());
+	JobHandle submitJob(const MapReduceClient& client,
+		InputSource& inputSource, OutputVec& outputVec,
+		int multiThreadLevel, const JobOptions& options = JobOptions());
+
+private:
+	EngineWorkers* workers;
+};
+
 void waitForJob(JobHandle job);
+// waits up to timeoutMilliseconds for the job to be done, 0 only checks. returns whether it is done, after
+// which it is used like a job waitForJob returned from.
+bool tryWaitForJob(JobHandle job, long timeoutMilliseconds);
+// an eventfd that becomes readable once the job is done, for epoll or poll. the job owns it and closes it
+// in closeJobHandle, reading it consumes the notification.
+int getJobEventFd(JobHandle job);
 void getJobState(JobHandle job, JobState* state);
+void getJobCounters(JobHandle job, JobCounters* counters);
 void closeJobHandle(JobHandle job);
+
+// the stats of a job started with collectStats, once waitForJob returned.
+void getJobStats(JobHandle job, JobStats* stats);
+// writes the stages every thread of a job started with collectStats went through as a chrome trace event
+// json file (for chrome://tracing or perfetto), once waitForJob returned.
+void writeJobTrace(JobHandle job, const std::string& path);
 	
 	
 #endif //MAPREDUCEFRAMEWORK_H
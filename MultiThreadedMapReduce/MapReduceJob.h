@@ -0,0 +1,291 @@
+#ifndef MAPREDUCEJOB_H
+#define MAPREDUCEJOB_H
+
+#include "MapReduceFramework.h"
+#include <vector>
+#include <utility>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+// the input of a typed job is cut into about this many splits per thread, which the map threads claim.
+#define MAPREDUCEJOB_SPLITS_PER_THREAD 16
+
+// a typed map reduce job. unlike MapReduceClient, map and reduce get the keys and values in their own types,
+// and the keys are compared by Compare without going through K2's operator<. the job runs on the framework
+// like any other: every intermediate pair is a single object in its thread's arena, and integral and
+// std::string keys compared by std::less are radix sorted by their key prefixes.
+// a job derives from this class and implements map and reduce, then run executes it. the outputs are
+// ordered by the K2 key they were reduced from.
+// the pairs are only moved, never copied. Compare must be default constructible.
+template <class K1, class V1, class K2, class V2, class K3, class V3, class Compare = std::less<K2>>
+class MapReduceJob {
+public:
+	typedef std::vector<std::pair<K1, V1>> InputVec;
+	typedef std::pair<K2, V2> IntermediatePair;
+	typedef std::vector<IntermediatePair> IntermediateVec;
+	typedef std::vector<std::pair<K3, V3>> OutputVec;
+
+	// where map puts its intermediate pairs.
+	class IntermediateEmitter {
+	public:
+		template <class K, class V>
+		void emit(K&& key, V&& value) {
+			// the virtual destructors of K2 and V2 have nothing to do, so only a pair that needs its destructor registers it.
+			void* memory = allocateIntermediateMemory(context, sizeof(TypedIntermediatePair),
+			                                          alignof(TypedIntermediatePair));
+			auto pair = new (memory) TypedIntermediatePair(std::forward<K>(key), std::forward<V>(value));
+			if (!std::is_trivially_destructible<IntermediatePair>::value) {
+				registerIntermediateDestructor(context, pair, &destroyIntermediate<TypedIntermediatePair>);
+			}
+			emit2(pair, pair, context);
+		}
+
+	private:
+		friend class MapReduceJob;
+		explicit IntermediateEmitter(void* context) : context(context) {}
+		void* context;
+	};
+
+	// where reduce puts its output pairs.
+	class OutputEmitter {
+	public:
+		template <class K, class V>
+		void emit(K&& key, V&& value) {
+			auto pair = new TypedOutputPair(std::forward<K>(key), std::forward<V>(value));
+			emit3(pair, pair, context);
+		}
+
+	private:
+		friend class MapReduceJob;
+		explicit OutputEmitter(void* context) : context(context) {}
+		void* context;
+	};
+
+	// the pairs of a single K2 key, valid only during the reduce call it is passed to.
+	class Group {
+	public:
+		class iterator {
+		public:
+			explicit iterator(const ::IntermediatePair* position) : position(position) {}
+			const IntermediatePair& operator*() const { return typedPair(*position); }
+			const IntermediatePair* operator->() const { return &typedPair(*position); }
+			iterator& operator++() { ++position; return *this; }
+			bool operator==(const iterator& other) const { return position == other.position; }
+			bool operator!=(const iterator& other) const { return position != other.position; }
+
+		private:
+			const ::IntermediatePair* position;
+		};
+
+		const K2& key() const { return typedPair(pairs.front()).first; }
+		iterator begin() const { return iterator(pairs.begin()); }
+		iterator end() const { return iterator(pairs.end()); }
+		size_t size() const { return pairs.size(); }
+		const IntermediatePair& operator[](size_t i) const { return typedPair(pairs[i]); }
+
+	private:
+		friend class MapReduceJob;
+		explicit Group(const IntermediateView& pairs) : pairs(pairs) {}
+		IntermediateView pairs;
+	};
+
+	class RunningJob;
+
+	virtual ~MapReduceJob() {}
+
+	// gets a single input pair and emits any number of intermediate pairs to out.
+	virtual void map(const K1& key, const V1& value, IntermediateEmitter& out) const = 0;
+
+	// gets all the pairs of a single K2 key and emits any number of output pairs to out.
+	virtual void reduce(const Group& group, OutputEmitter& out) const = 0;
+
+	// starts the job on multiThreadLevel threads like startMapReduceJob, with the same options, except that
+	// deterministicOutput is always set. the options that need a client's combiner, serializer, key hash or
+	// associative reduce are not used. inputVec and outputVec must outlive the run.
+	std::unique_ptr<RunningJob> start(const InputVec& inputVec, OutputVec& outputVec, int multiThreadLevel,
+	                                  const JobOptions& options = JobOptions()) const
+	{
+		size_t number_of_splits = (size_t)std::max(1, multiThreadLevel) * MAPREDUCEJOB_SPLITS_PER_THREAD;
+		size_t split_size = std::max((size_t)1, inputVec.size() / number_of_splits);
+		std::unique_ptr<RunningJob> running(new RunningJob(*this, inputVec, outputVec, split_size));
+		JobOptions typed_options = options;
+		typed_options.deterministicOutput = true;
+		running->job = startMapReduceJob(running->client, running->input, running->outputs, multiThreadLevel,
+		                                 typed_options);
+		return running;
+	}
+
+	// runs the job on multiThreadLevel threads and appends its outputs to outputVec. returns once the job
+	// is done.
+	void run(const InputVec& inputVec, OutputVec& outputVec, int multiThreadLevel,
+	         const JobOptions& options = JobOptions()) const
+	{
+		start(inputVec, outputVec, multiThreadLevel, options)->finish();
+	}
+
+private:
+	// an emitted pair, which the framework gets as both the key and the value of the pair.
+	struct TypedIntermediatePair : public ::K2, public ::V2 {
+		template <class K, class V>
+		TypedIntermediatePair(K&& key, V&& value) : pair(std::forward<K>(key), std::forward<V>(value)) {}
+		bool operator<(const ::K2& other) const {
+			return Compare()(pair.first, static_cast<const TypedIntermediatePair&>(other).pair.first);
+		}
+		IntermediatePair pair;
+	};
+
+	// an output pair, the framework gets it as both the key and the value of the output.
+	struct TypedOutputPair : public ::K3, public ::V3 {
+		template <class K, class V>
+		TypedOutputPair(K&& key, V&& value) : pair(std::forward<K>(key), std::forward<V>(value)) {}
+		// the framework never compares the outputs.
+		bool operator<(const ::K3& other) const { return false; }
+		// inside this class K3 names the base class, so the pair's type comes from OutputVec.
+		typename OutputVec::value_type pair;
+	};
+
+	static const IntermediatePair& typedPair(const ::IntermediatePair& pair)
+	{
+		return static_cast<const TypedIntermediatePair*>(pair.first)->pair;
+	}
+
+	typedef std::integral_constant<bool, std::is_integral<K2>::value && !std::is_same<K2, bool>::value &&
+	                                     std::is_same<Compare, std::less<K2>>::value> IntegralPrefix;
+	typedef std::integral_constant<bool, std::is_same<K2, std::string>::value &&
+	                                     std::is_same<Compare, std::less<K2>>::value> StringPrefix;
+
+	static uint64_t keyPrefix(const K2& key, std::false_type, std::false_type)
+	{
+		return 0;
+	}
+
+	/**
+	 * the key itself, with the sign bit flipped so the signed keys are ordered like their unsigned images.
+	 */
+	static uint64_t keyPrefix(const K2& key, std::true_type, std::false_type)
+	{
+		typedef typename std::make_unsigned<K2>::type UnsignedKey;
+		UnsignedKey sign_flip = std::is_signed<K2>::value ? (UnsignedKey)((UnsignedKey)1 << (8 * sizeof(K2) - 1)) :
+		                                                   (UnsignedKey)0;
+		return (UnsignedKey)((UnsignedKey)key ^ sign_flip);
+	}
+
+	/**
+	 * the first 8 bytes of the key, big endian and padded with zeros.
+	 */
+	static uint64_t keyPrefix(const K2& key, std::false_type, std::true_type)
+	{
+		uint64_t prefix = 0;
+		size_t length = std::min(key.size(), sizeof(prefix));
+		for (size_t i = 0; i < length; ++i) {
+			prefix |= (uint64_t)(unsigned char)key[i] << (8 * (sizeof(prefix) - 1 - i));
+		}
+		return prefix;
+	}
+
+	// runs the job's map and reduce for the framework. the keys map gets are the indices of its input pairs.
+	class Client : public MapReduceClient {
+	public:
+		Client(const MapReduceJob& mapReduceJob, const InputVec& inputVec)
+				: mapReduceJob(mapReduceJob), inputVec(inputVec) {}
+		void map(const ::K1* key, const ::V1* value, void* context) const {
+			const std::pair<K1, V1>& input = inputVec[static_cast<const InputRecord*>(key)->offset];
+			IntermediateEmitter out(context);
+			mapReduceJob.map(input.first, input.second, out);
+		}
+		void reduce(const ::IntermediateVec* pairs, void* context) const {
+			reduceView(IntermediateView(*pairs), context);
+		}
+		void reduceView(const IntermediateView& pairs, void* context) const {
+			OutputEmitter out(context);
+			mapReduceJob.reduce(Group(pairs), out);
+		}
+		uint64_t intermediateKeyPrefix(const ::K2* key) const {
+			return keyPrefix(static_cast<const TypedIntermediatePair*>(key)->pair.first, IntegralPrefix(),
+			                 StringPrefix());
+		}
+		bool hasKeyPrefix() const { return IntegralPrefix::value || StringPrefix::value; }
+		bool keyPrefixIsKey() const { return IntegralPrefix::value; }
+
+	private:
+		const MapReduceJob& mapReduceJob;
+		const InputVec& inputVec;
+	};
+
+	// the indices of the input pairs, claimed in splits of splitSize.
+	class InputIndices : public InputSource {
+	public:
+		InputIndices(size_t size, size_t splitSize) : size(size), splitSize(splitSize), nextSplit(0) {}
+		size_t numberOfSplits() const { return (size + splitSize - 1) / splitSize; }
+		bool claimSplit(InputSplit* split) {
+			size_t index = nextSplit.fetch_add(1);
+			if (index >= numberOfSplits()) {
+				return false;
+			}
+			split->begin = index * splitSize;
+			split->end = std::min(split->begin + splitSize, (uint64_t)size);
+			split->position = split->begin;
+			return true;
+		}
+		bool nextRecord(InputSplit* split, InputRecord* record) {
+			if (split->position >= split->end) {
+				return false;
+			}
+			record->offset = split->position++;
+			return true;
+		}
+
+	private:
+		size_t size;
+		size_t splitSize;
+		std::atomic<size_t> nextSplit;
+	};
+
+public:
+	// a run of the job that start began. handle() is its JobHandle, for getJobState, tryWaitForJob,
+	// getJobStats and the rest, except closeJobHandle: finish waits for the job, moves its outputs to the
+	// output vector given to start and closes the handle. a run that wasn't finished is finished when it
+	// is destroyed.
+	class RunningJob {
+	public:
+		~RunningJob() {
+			if (job != nullptr) {
+				finish();
+			}
+		}
+		JobHandle handle() const { return job; }
+		void finish() {
+			waitForJob(job);
+			for (const OutputPair& output : outputs) {
+				auto pair = static_cast<TypedOutputPair*>(output.first);
+				outputVec.push_back(std::move(pair->pair));
+				delete pair;
+			}
+			::OutputVec().swap(outputs);
+			closeJobHandle(job);
+			job = nullptr;
+		}
+
+	private:
+		friend class MapReduceJob;
+		RunningJob(const MapReduceJob& mapReduceJob, const InputVec& inputVec, OutputVec& outputVec,
+		           size_t splitSize)
+				: client(mapReduceJob, inputVec), input(inputVec.size(), splitSize), outputVec(outputVec),
+				  job(nullptr) {}
+		RunningJob(const RunningJob&) = delete;
+		RunningJob& operator=(const RunningJob&) = delete;
+
+		Client client;
+		InputIndices input;
+		OutputVec& outputVec;
+		::OutputVec outputs;
+		JobHandle job;
+	};
+};
+
+#endif //MAPREDUCEJOB_H
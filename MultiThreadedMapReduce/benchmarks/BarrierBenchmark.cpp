@@ -0,0 +1,105 @@
+#include "Barrier.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <pthread.h>
+#include <vector>
+
+// compares the barrier with the mutex and condition variable barrier it replaced, by timing threads that do
+// nothing but wait at the barrier. the barrier runs once sleeping right away and once with its default
+// spinning, which only spins when the machine has a cpu for every thread.
+//
+// usage: BarrierBenchmark [number of rounds] [max number of threads]
+
+#define DEFAULT_ROUNDS 20000
+#define DEFAULT_MAX_THREADS 16
+#define REPETITIONS 3
+
+// the previous barrier, every thread locks the mutex and all but the last sleep on the condition variable.
+class CondBarrier {
+public:
+    explicit CondBarrier(int numThreads)
+        : mutex(PTHREAD_MUTEX_INITIALIZER), cv(PTHREAD_COND_INITIALIZER), count(0), generation(0),
+          numThreads(numThreads) {}
+
+    void barrier(int threadId)
+    {
+        pthread_mutex_lock(&mutex);
+        int my_generation = generation;
+        if (++count < numThreads) {
+            while (generation == my_generation) {pthread_cond_wait(&cv, &mutex);}
+        } else {
+            count = 0;
+            ++generation;
+            pthread_cond_broadcast(&cv);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+private:
+    pthread_mutex_t mutex;
+    pthread_cond_t cv;
+    int count;
+    int generation;
+    int numThreads;
+};
+
+template <class B>
+struct Worker {
+    B* barrier;
+    int threadId;
+    int rounds;
+};
+
+template <class B>
+void* waitRounds(void* arg)
+{
+    auto worker = static_cast<Worker<B>*>(arg);
+    for (int i = 0; i < worker->rounds; ++i) {worker->barrier->barrier(worker->threadId);}
+    return nullptr;
+}
+
+/**
+ * returns the best time in nanoseconds a round of the barrier took, over REPETITIONS runs of the rounds.
+ */
+template <class B>
+double nanosecondsPerRound(B& barrier, int threads, int rounds)
+{
+    double best = 0;
+    for (int r = 0; r < REPETITIONS; ++r) {
+        std::vector<pthread_t> handles(threads);
+        std::vector<Worker<B>> workers(threads);
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < threads; ++i) {
+            workers[i] = Worker<B>{&barrier, i, rounds};
+            if (pthread_create(&handles[i], nullptr, waitRounds<B>, &workers[i]) != 0) {
+                fprintf(stderr, "system error: pthread_create failed\n");
+                exit(1);
+            }
+        }
+        for (pthread_t handle : handles) {pthread_join(handle, nullptr);}
+        double nanoseconds = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start)
+                             .count() / rounds;
+        if (r == 0 || nanoseconds < best) {best = nanoseconds;}
+    }
+    return best;
+}
+
+int main(int argc, char** argv)
+{
+    int rounds = (argc > 1) ? atoi(argv[1]) : DEFAULT_ROUNDS;
+    int max_threads = (argc > 2) ? atoi(argv[2]) : DEFAULT_MAX_THREADS;
+
+    printf("%8s %14s %14s %14s %8s\n", "threads", "cond_ns", "sleeping_ns", "default_ns", "speedup");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        CondBarrier cond_barrier(threads);
+        Barrier sleeping_barrier(threads, 0);
+        Barrier default_barrier(threads);
+        double cond_ns = nanosecondsPerRound(cond_barrier, threads, rounds);
+        double sleeping_ns = nanosecondsPerRound(sleeping_barrier, threads, rounds);
+        double default_ns = nanosecondsPerRound(default_barrier, threads, rounds);
+        printf("%8d %14.0f %14.0f %14.0f %7.2fx\n", threads, cond_ns, sleeping_ns, default_ns,
+               cond_ns / default_ns);
+    }
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include "MapReduceFramework.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// compares claiming the map and reduce items one at a time with the default guided chunk claiming,
+// using a job whose map and reduce functions are as cheap as possible.
+//
+// usage: ClaimingBenchmark [number of input pairs] [max multiThreadLevel]
+
+#define DEFAULT_INPUT_SIZE 1000000
+#define DEFAULT_MAX_THREADS 16
+#define NUM_OF_KEYS 100000
+#define REPETITIONS 3
+
+class KInt : public K1, public K2, public K3 {
+public:
+    explicit KInt(int value) : value(value) {}
+    bool operator<(const K1& other) const {return value < static_cast<const KInt&>(other).value;}
+    bool operator<(const K2& other) const {return value < static_cast<const KInt&>(other).value;}
+    bool operator<(const K3& other) const {return value < static_cast<const KInt&>(other).value;}
+    int value;
+};
+
+class VNone : public V1, public V2, public V3 {};
+
+class CheapClient : public MapReduceClient {
+public:
+    explicit CheapClient(std::vector<KInt>& keys) : keys(keys) {}
+
+    void map(const K1* key, const V1* value, void* context) const
+    {
+        emit2(&keys[static_cast<const KInt*>(key)->value % NUM_OF_KEYS], nullptr, context);
+    }
+
+    void reduce(const IntermediateVec* pairs, void* context) const
+    {
+        emit3(static_cast<KInt*>(pairs->front().first), nullptr, context);
+    }
+
+private:
+    std::vector<KInt>& keys;
+};
+
+double runJob(const MapReduceClient& client, const InputVec& inputVec, int multiThreadLevel,
+              const JobOptions& options)
+{
+    double best_seconds = 0;
+    for (int i = 0; i < REPETITIONS; ++i) {
+        OutputVec outputVec;
+        auto start = std::chrono::steady_clock::now();
+        JobHandle job = startMapReduceJob(client, inputVec, outputVec, multiThreadLevel, options);
+        closeJobHandle(job);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (i == 0 || seconds < best_seconds) {best_seconds = seconds;}
+    }
+    return best_seconds;
+}
+
+int main(int argc, char** argv)
+{
+    int input_size = (argc > 1) ? atoi(argv[1]) : DEFAULT_INPUT_SIZE;
+    int max_threads = (argc > 2) ? atoi(argv[2]) : DEFAULT_MAX_THREADS;
+
+    std::vector<KInt> keys;
+    for (int i = 0; i < std::max(input_size, NUM_OF_KEYS); ++i) {keys.push_back(KInt(i));}
+    InputVec inputVec;
+    for (int i = 0; i < input_size; ++i) {inputVec.push_back(InputPair(&keys[i], nullptr));}
+    CheapClient client(keys);
+
+    JobOptions one_at_a_time;
+    one_at_a_time.claimChunkSize = 1;
+    JobOptions guided;
+
+    printf("%8s %14s %14s %8s\n", "threads", "one_at_a_time", "guided", "speedup");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double one_at_a_time_seconds = runJob(client, inputVec, threads, one_at_a_time);
+        double guided_seconds = runJob(client, inputVec, threads, guided);
+        printf("%8d %13.4fs %13.4fs %7.2fx\n", threads, one_at_a_time_seconds, guided_seconds,
+               one_at_a_time_seconds / guided_seconds);
+    }
+    return 0;
+}
@@ -0,0 +1,378 @@
+#include "MapReduceFramework.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// runs synthetic jobs over a sweep of multiThreadLevel and input sizes, and prints one csv line per job
+// with its throughput, the time of its slowest thread in every stage and the peak rss of the process that
+// ran it. every job runs in a child process of its own, so the peak rss is the job's alone.
+//
+// the workloads:
+//   wordcount      counts the words of random lines over a uniform vocabulary.
+//   wordcountbytes the same count, with the words emitted as bytes by emit2Bytes.
+//   invertedindex  lists the documents every word of a uniform vocabulary appears in.
+//   zipf           a histogram of keys drawn from a zipf distribution, most pairs share a few keys.
+//   join           joins two relations on a small key domain, every reduce is a cross product.
+//
+// usage: MapReduceBenchmark [max multiThreadLevel] [number of input pairs ...]
+
+#define DEFAULT_MAX_THREADS 16
+#define DEFAULT_INPUT_SIZES {100000, 1000000}
+#define REPETITIONS 3
+#define WORDS_PER_LINE 10
+#define VOCABULARY_SIZE 10000
+#define ZIPF_KEYS 100000
+#define ZIPF_EXPONENT 1.1
+#define ZIPF_KEYS_PER_INPUT 10
+// the join has about this many pairs of each relation per key.
+#define JOIN_PAIRS_PER_KEY 250
+#define RANDOM_SEED 12345
+
+class KInt : public K1, public K2, public K3 {
+public:
+    explicit KInt(long value) : value(value) {}
+    bool operator<(const K1& other) const {return value < static_cast<const KInt&>(other).value;}
+    bool operator<(const K2& other) const {return value < static_cast<const KInt&>(other).value;}
+    bool operator<(const K3& other) const {return value < static_cast<const KInt&>(other).value;}
+    long value;
+};
+
+class VInt : public V1, public V2, public V3 {
+public:
+    explicit VInt(long value) : value(value) {}
+    long value;
+};
+
+class KString : public K2, public K3 {
+public:
+    explicit KString(const std::string& word) : word(word) {}
+    bool operator<(const K2& other) const {return word < static_cast<const KString&>(other).word;}
+    bool operator<(const K3& other) const {return word < static_cast<const KString&>(other).word;}
+    std::string word;
+};
+
+class VString : public V1 {
+public:
+    explicit VString(const std::string& text) : text(text) {}
+    std::string text;
+};
+
+class VKeys : public V1 {
+public:
+    std::vector<long> keys;
+};
+
+// a pair of the join input, from the left relation or from the right one.
+class VRow : public V1, public V2 {
+public:
+    VRow(bool left, long payload) : left(left), payload(payload) {}
+    bool left;
+    long payload;
+};
+
+/**
+ * emits every word of text with make_value(word) as its value.
+ */
+template <class MakeValue>
+void emitWords(const std::string& text, void* context, MakeValue make_value)
+{
+    size_t word_start = 0;
+    while (word_start < text.size())
+    {
+        size_t word_end = text.find(' ', word_start);
+        if (word_end == std::string::npos) {word_end = text.size();}
+        if (word_end > word_start)
+        {
+            std::string word = text.substr(word_start, word_end - word_start);
+            emit2(allocateIntermediate<KString>(context, word), make_value(context), context);
+        }
+        word_start = word_end + 1;
+    }
+}
+
+class WordCountClient : public MapReduceClient {
+public:
+    void map(const K1* key, const V1* value, void* context) const
+    {
+        emitWords(static_cast<const VString*>(value)->text, context,
+                  [](void* context){return allocateIntermediate<VInt>(context, 1);});
+    }
+
+    void reduce(const IntermediateVec* pairs, void* context) const
+    {
+        long count = 0;
+        for (const IntermediatePair& pair : *pairs) {count += static_cast<const VInt*>(pair.second)->value;}
+        emit3(new KString(static_cast<const KString*>(pairs->front().first)->word), new VInt(count), context);
+    }
+};
+
+class WordCountBytesClient : public MapReduceClient {
+public:
+    void map(const K1* key, const V1* value, void* context) const
+    {
+        const std::string& text = static_cast<const VString*>(value)->text;
+        size_t word_start = 0;
+        while (word_start < text.size())
+        {
+            size_t word_end = text.find(' ', word_start);
+            if (word_end == std::string::npos) {word_end = text.size();}
+            if (word_end > word_start) {
+                emit2Bytes(text.data() + word_start, word_end - word_start, nullptr, 0, context);
+            }
+            word_start = word_end + 1;
+        }
+    }
+
+    void reduce(const IntermediateVec* pairs, void* context) const
+    {
+        auto word = static_cast<const IntermediateBytes*>(pairs->front().first);
+        emit3(new KString(std::string(word->keyData(), word->keySize())), new VInt(pairs->size()), context);
+    }
+};
+
+class InvertedIndexClient : public MapReduceClient {
+public:
+    void map(const K1* key, const V1* value, void* context) const
+    {
+        long document = static_cast<const KInt*>(key)->value;
+        emitWords(static_cast<const VString*>(value)->text, context,
+                  [document](void* context){return allocateIntermediate<VInt>(context, document);});
+    }
+
+    void reduce(const IntermediateVec* pairs, void* context) const
+    {
+        std::vector<long> documents;
+        for (const IntermediatePair& pair : *pairs) {documents.push_back(static_cast<const VInt*>(pair.second)->value);}
+        std::sort(documents.begin(), documents.end());
+        long number_of_documents = std::unique(documents.begin(), documents.end()) - documents.begin();
+        emit3(new KString(static_cast<const KString*>(pairs->front().first)->word), new VInt(number_of_documents),
+              context);
+    }
+};
+
+class ZipfClient : public MapReduceClient {
+public:
+    void map(const K1* key, const V1* value, void* context) const
+    {
+        for (long drawn_key : static_cast<const VKeys*>(value)->keys) {
+            emit2(allocateIntermediate<KInt>(context, drawn_key), allocateIntermediate<VInt>(context, 1), context);
+        }
+    }
+
+    void reduce(const IntermediateVec* pairs, void* context) const
+    {
+        emit3(new KInt(static_cast<const KInt*>(pairs->front().first)->value), new VInt(pairs->size()), context);
+    }
+};
+
+class JoinClient : public MapReduceClient {
+public:
+    void map(const K1* key, const V1* value, void* context) const
+    {
+        auto row = static_cast<const VRow*>(value);
+        emit2(allocateIntermediate<KInt>(context, static_cast<const KInt*>(key)->value),
+              allocateIntermediate<VRow>(context, row->left, row->payload), context);
+    }
+
+    void reduce(const IntermediateVec* pairs, void* context) const
+    {
+        long joined = 0;
+        for (const IntermediatePair& left : *pairs)
+        {
+            auto left_row = static_cast<const VRow*>(left.second);
+            if (!left_row->left) {continue;}
+            for (const IntermediatePair& right : *pairs)
+            {
+                auto right_row = static_cast<const VRow*>(right.second);
+                if (!right_row->left) {
+                    joined += (left_row->payload * right_row->payload) % 7;
+                }
+            }
+        }
+        emit3(new KInt(static_cast<const KInt*>(pairs->front().first)->value), new VInt(joined), context);
+    }
+};
+
+std::string randomLine(std::mt19937& random)
+{
+    std::uniform_int_distribution<int> words(0, VOCABULARY_SIZE - 1);
+    std::string line;
+    for (int i = 0; i < WORDS_PER_LINE; ++i) {
+        line += "w" + std::to_string(words(random)) + " ";
+    }
+    return line;
+}
+
+/**
+ * creates the input pairs of the named workload, returns nullptr for an unknown workload.
+ */
+MapReduceClient* createWorkload(const std::string& workload, int input_size, InputVec& inputVec)
+{
+    std::mt19937 random(RANDOM_SEED);
+    if (workload == "wordcount" || workload == "wordcountbytes" || workload == "invertedindex")
+    {
+        for (int i = 0; i < input_size; ++i) {
+            inputVec.push_back(InputPair(new KInt(i), new VString(randomLine(random))));
+        }
+        static WordCountClient word_count;
+        static WordCountBytesClient word_count_bytes;
+        static InvertedIndexClient inverted_index;
+        if (workload == "wordcount") {return &word_count;}
+        if (workload == "wordcountbytes") {return &word_count_bytes;}
+        return &inverted_index;
+    }
+    if (workload == "zipf")
+    {
+        std::vector<double> cumulative(ZIPF_KEYS);
+        double sum = 0;
+        for (int k = 0; k < ZIPF_KEYS; ++k) {
+            sum += 1.0 / std::pow(k + 1, ZIPF_EXPONENT);
+            cumulative[k] = sum;
+        }
+        std::uniform_real_distribution<double> uniform(0, sum);
+        for (int i = 0; i < input_size; ++i)
+        {
+            auto keys = new VKeys();
+            for (int j = 0; j < ZIPF_KEYS_PER_INPUT; ++j) {
+                keys->keys.push_back(std::lower_bound(cumulative.begin(), cumulative.end(), uniform(random)) -
+                                     cumulative.begin());
+            }
+            inputVec.push_back(InputPair(new KInt(i), keys));
+        }
+        static ZipfClient zipf;
+        return &zipf;
+    }
+    if (workload == "join")
+    {
+        std::uniform_int_distribution<long> keys(0, std::max(1, input_size / (2 * JOIN_PAIRS_PER_KEY)) - 1);
+        for (int i = 0; i < input_size; ++i) {
+            inputVec.push_back(InputPair(new KInt(keys(random)), new VRow(i % 2 == 0, i)));
+        }
+        static JoinClient join;
+        return &join;
+    }
+    return nullptr;
+}
+
+double seconds(unsigned long long nanoseconds)
+{
+    return nanoseconds / 1e9;
+}
+
+/**
+ * runs the workload REPETITIONS times and prints the csv line of the fastest run.
+ */
+void runBenchmark(const std::string& workload, int threads, int input_size)
+{
+    InputVec inputVec;
+    MapReduceClient* client = createWorkload(workload, input_size, inputVec);
+    if (client == nullptr)
+    {
+        std::cerr << "unknown workload " << workload << "\n";
+        exit(1);
+    }
+
+    JobOptions options;
+    options.collectStats = true;
+    JobStats best_stats;
+    double best_seconds = 0;
+    size_t num_of_outputs = 0;
+    for (int i = 0; i < REPETITIONS; ++i)
+    {
+        OutputVec outputVec;
+        auto start = std::chrono::steady_clock::now();
+        JobHandle job = startMapReduceJob(*client, inputVec, outputVec, threads, options);
+        waitForJob(job);
+        double run_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (i == 0 || run_seconds < best_seconds)
+        {
+            best_seconds = run_seconds;
+            getJobStats(job, &best_stats);
+            num_of_outputs = outputVec.size();
+        }
+        closeJobHandle(job);
+        for (OutputPair& pair : outputVec)
+        {
+            delete pair.first;
+            delete pair.second;
+        }
+    }
+
+    // a stage takes as long as its slowest thread.
+    ThreadStats slowest = ThreadStats();
+    unsigned long num_of_intermediate_pairs = 0;
+    for (const ThreadStats& thread : best_stats.threads)
+    {
+        slowest.mapTime = std::max(slowest.mapTime, thread.mapTime);
+        slowest.sortTime = std::max(slowest.sortTime, thread.sortTime);
+        slowest.shuffleTime = std::max(slowest.shuffleTime, thread.shuffleTime);
+        slowest.reduceTime = std::max(slowest.reduceTime, thread.reduceTime);
+        slowest.outputTime = std::max(slowest.outputTime, thread.outputTime);
+        slowest.barrierWaitTime = std::max(slowest.barrierWaitTime, thread.barrierWaitTime);
+        num_of_intermediate_pairs += thread.intermediatePairs;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%s,%d,%d,%lu,%zu,%.6f,%.0f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%ld\n", workload.c_str(), threads, input_size,
+           num_of_intermediate_pairs, num_of_outputs, best_seconds, input_size / best_seconds,
+           seconds(slowest.mapTime), seconds(slowest.sortTime), seconds(slowest.shuffleTime),
+           seconds(slowest.reduceTime), seconds(slowest.outputTime), seconds(slowest.barrierWaitTime),
+           usage.ru_maxrss);
+    fflush(stdout);
+
+    for (InputPair& pair : inputVec)
+    {
+        delete pair.first;
+        delete pair.second;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int max_threads = (argc > 1) ? atoi(argv[1]) : DEFAULT_MAX_THREADS;
+    std::vector<int> input_sizes;
+    for (int i = 2; i < argc; ++i) {input_sizes.push_back(atoi(argv[i]));}
+    if (input_sizes.empty()) {input_sizes = DEFAULT_INPUT_SIZES;}
+
+    printf("workload,threads,input_pairs,intermediate_pairs,output_pairs,seconds,input_pairs_per_second,"
+           "map_seconds,sort_seconds,shuffle_seconds,reduce_seconds,output_seconds,barrier_wait_seconds,"
+           "peak_rss_kb\n");
+    fflush(stdout);
+    for (const char* workload : {"wordcount", "wordcountbytes", "invertedindex", "zipf", "join"})
+    {
+        for (int input_size : input_sizes)
+        {
+            for (int threads = 1; threads <= max_threads; threads *= 2)
+            {
+                pid_t pid = fork();
+                if (pid < 0)
+                {
+                    std::cerr << "system error: fork failed\n";
+                    exit(1);
+                }
+                if (pid == 0)
+                {
+                    runBenchmark(workload, threads, input_size);
+                    exit(0);
+                }
+                int status;
+                if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                {
+                    std::cerr << "benchmark " << workload << " failed\n";
+                    exit(1);
+                }
+            }
+        }
+    }
+    return 0;
+}